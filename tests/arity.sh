@@ -0,0 +1,12 @@
+# A call with the wrong number of arguments names the right count, whether
+# it is a built-in, a call evaluated directly or one compiled in a loop
+set -e
+check() {
+    printf "$1" > "$TMP/arity.zeta"
+    if $ZETA "$TMP/arity.zeta" > /dev/null 2> "$TMP/arity.err"; then exit 1; fi
+    [ "$(cat "$TMP/arity.err")" = "$2" ]
+}
+check 'a = sum(1, 2)\n' "Function sum takes 1 argument"
+check 'def f(x) = x\na = f(1, 2)\n' "Function f takes 1 argument"
+check 'def g(x, y) = x\nrepeat 2 { a = g(1) }\n' "Function g takes 2 arguments"
+check 'def h(x) = x\nrepeat 2 { a = h(1, 2) }\n' "Function h takes 1 argument"
@@ -0,0 +1,26 @@
+# Binary formats hold the same values as the text one, and -o also takes text
+set -e
+# Doubles of a file as "%g" text, one per line
+doubles() { od -An -v -t f8 "$1" | tr -s ' ' '\n' | sed '/^$/d' | xargs printf '%g\n'; }
+
+$ZETA -o "$TMP/text.out" formats.zeta > "$TMP/stdout"
+cmp formats.out "$TMP/text.out"
+[ ! -s "$TMP/stdout" ]
+
+$ZETA --format raw formats.zeta > "$TMP/raw.f64"
+[ "$(doubles "$TMP/raw.f64" | tr '\n' ' ')" = "1 0.5 1 2 3 2 " ]
+
+$ZETA --format records -o "$TMP/out.rec" formats.zeta
+od -An -v -t u4 -N 4 "$TMP/out.rec" | grep -qx ' *2'
+[ "$(wc -c < "$TMP/out.rec")" -eq $((3 * 4 + 6 * 8)) ]
+
+mkdir "$TMP/cols"
+echo stale > "$TMP/cols/old.f64"
+$ZETA --format columns -o "$TMP/cols" formats.zeta
+[ ! -e "$TMP/cols/old.f64" ]
+[ "$(doubles "$TMP/cols/a.f64" | tr '\n' ' ')" = "1 2 " ]
+[ "$(doubles "$TMP/cols/v.f64" | tr '\n' ' ')" = "1 2 3 " ]
+
+# A failed write is reported, not crashed on at exit
+if $ZETA --format raw -o /dev/full formats.zeta 2> "$TMP/full.err"; then exit 1; fi
+grep -q "Failed to write output" "$TMP/full.err"
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Behaviour tests, run by `make test` against the interpreter in $ZETA:
+#   name.zeta  a program; name.out is what it must print on stdout, name.err
+#              on stderr (empty if there is no such file) and name.args holds
+#              extra arguments. Programs must print the same with -j 4, which
+#              starts 4 workers on any machine (the waves of parallel.zeta
+#              are big enough for them to share).
+#   name.sh    a script (run from tests/ with ZETA set) that fails with a
+#              non-zero status and a message
+ZETA=$(cd "$(dirname "${ZETA:-bin/zeta}")" && pwd)/$(basename "${ZETA:-bin/zeta}")
+export ZETA
+cd "$(dirname "$0")" || exit 1
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+passed=0
+
+# check name expected_out expected_err actual_out actual_err label
+check() {
+    if cmp -s "$2" "$4" && cmp -s "$3" "$5"; then
+        passed=$((passed + 1))
+    else
+        failed=$((failed + 1))
+        echo "FAIL $1 ($6)"
+        diff "$2" "$4" | head -5
+        diff "$3" "$5" | head -5
+    fi
+}
+
+for test in *.zeta; do
+    name=${test%.zeta}
+    args=$(cat "$name.args" 2>/dev/null)
+    err=$name.err
+    [ -f "$err" ] || err=/dev/null
+    $ZETA $args "$test" > "$tmp/out" 2> "$tmp/err"
+    check "$name" "$name.out" "$err" "$tmp/out" "$tmp/err" "$ZETA $args $test"
+    $ZETA -j 4 $args "$test" > "$tmp/out" 2> "$tmp/err"
+    check "$name" "$name.out" "$err" "$tmp/out" "$tmp/err" "$ZETA -j 4 $args $test"
+done
+
+for test in *.sh; do
+    [ "$test" = run.sh ] && continue
+    if TMP=$tmp sh "$test" > "$tmp/log" 2>&1; then
+        passed=$((passed + 1))
+    else
+        failed=$((failed + 1))
+        echo "FAIL ${test%.sh}"
+        head -10 "$tmp/log"
+    fi
+done
+
+echo "$passed passed, $failed failed"
+[ "$failed" -eq 0 ]
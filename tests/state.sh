@@ -0,0 +1,46 @@
+# Variables saved to a state file come back as they were when it is loaded
+set -e
+printf 'n = 1.5; big = 1e400; v = [1, 2.25, -3]; e = []\nw = v * 2\n' > "$TMP/base.zeta"
+$ZETA --save-state "$TMP/base.state" "$TMP/base.zeta" > /dev/null
+printf 'a = n; b = big; c = v; d = e; f = w - v\ng = sum(v) + len(e)\n' > "$TMP/next.zeta"
+$ZETA --load-state "$TMP/base.state" "$TMP/next.zeta" > "$TMP/next.out"
+printf '1.5 inf [1, 2.25, -3] [] [1, 2.25, -3] \n0.25 \n' | cmp - "$TMP/next.out"
+
+# A run that loads and saves the same file continues from the last one
+printf 'n = n + 1; v = -v\n' > "$TMP/step.zeta"
+cp "$TMP/base.state" "$TMP/step.state"
+$ZETA --load-state "$TMP/step.state" --save-state "$TMP/step.state" "$TMP/step.zeta" > /dev/null
+$ZETA --load-state "$TMP/step.state" --save-state "$TMP/step.state" "$TMP/step.zeta" > "$TMP/step.out"
+printf '3.5 [1, 2.25, -3] \n' | cmp - "$TMP/step.out"
+
+# A save that fails leaves no temporary file behind: neither when writing
+# it fails (it leads to /dev/full) nor when it can't replace the file
+if [ -w /dev/full ]; then
+    ln -s /dev/full "$TMP/full.state.tmp"
+    if $ZETA --save-state "$TMP/full.state" "$TMP/base.zeta" > /dev/null 2> "$TMP/full.err"; then exit 1; fi
+    grep -q "Cannot write" "$TMP/full.err"
+    [ ! -e "$TMP/full.state.tmp" ]
+fi
+mkdir -p "$TMP/dir.state/sub"
+if $ZETA --save-state "$TMP/dir.state" "$TMP/base.zeta" > /dev/null 2> "$TMP/dir.err"; then exit 1; fi
+grep -q "Cannot replace" "$TMP/dir.err"
+[ ! -e "$TMP/dir.state.tmp" ]
+
+# In watch mode every run starts from the file as it was at the start
+runs() {
+    for i in $(seq 100); do
+        [ "$(grep -c '^\[watch\]' "$TMP/watch.err")" -ge "$1" ] && return 0
+        sleep 0.1
+    done
+    echo "no run $1"; cat "$TMP/watch.err"; exit 1
+}
+cp "$TMP/base.state" "$TMP/watch.state"
+$ZETA --watch --load-state "$TMP/watch.state" --save-state "$TMP/watch.state" -o "$TMP/watch.out" \
+    "$TMP/step.zeta" 2> "$TMP/watch.err" &
+pid=$!
+trap 'kill $pid 2>/dev/null || :' EXIT
+runs 1
+printf 'n = n + 1; v = -v\nm = n\n' > "$TMP/step.zeta"
+runs 2
+printf '2.5 [-1, -2.25, 3] \n2.5 \n' | cmp - "$TMP/watch.out"
+kill $pid
@@ -0,0 +1,11 @@
+# Programs read from a pipe, which can't be rewound, print the same
+cat stream.zeta | $ZETA /dev/stdin > "$TMP/pipe.out" 2> "$TMP/pipe.err"
+cmp stream.out "$TMP/pipe.out" && cmp stream.err "$TMP/pipe.err"
+
+# A line from a pipe is recorded on disk, not in memory: 14 MB of it run
+# in 16 MB of address space (checked where the build runs in that at all)
+if (ulimit -v 16000 && echo 'a = 1' | $ZETA /dev/stdin) > /dev/null 2>&1; then
+    awk 'BEGIN { for (i = 0; i < 2000000; i++) printf "x = %d; ", i % 7; print "y = x" }' |
+        (ulimit -v 16000 && $ZETA /dev/stdin) | tail -c 5 > "$TMP/big.out"
+    printf '1 1 \n' | cmp - "$TMP/big.out"
+fi
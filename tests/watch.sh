@@ -0,0 +1,43 @@
+# --watch runs the file again when it changes, starting its output over
+set -e
+# Wait until the watcher has finished n runs
+runs() {
+    for i in $(seq 100); do
+        [ "$(grep -c '\[watch\]' "$TMP/watch.err")" -ge "$1" ] && return 0
+        sleep 0.1
+    done
+    echo "no run $1"; cat "$TMP/watch.err"; exit 1
+}
+
+printf 'a = 1; b = 2\nc = a + b\n' > "$TMP/prog.zeta"
+$ZETA --watch --stats --format raw -o "$TMP/out.f64" "$TMP/prog.zeta" 2> "$TMP/watch.err" &
+pid=$!
+trap 'kill $pid 2>/dev/null || :' EXIT
+runs 1
+[ "$(wc -c < "$TMP/out.f64")" -eq 24 ]
+
+# Cached lines, a new one, then an error: each run replaces the output
+printf 'a = 1; b = 2\nmemo f(x) = x * 2\nc = f(a + b)\n' > "$TMP/prog.zeta"
+runs 2
+[ "$(wc -c < "$TMP/out.f64")" -eq 24 ]
+grep -q "memo f: 0 hits, 1 misses" "$TMP/watch.err"
+printf 'a = 1; b = 2\nc = a / 0\n' > "$TMP/prog.zeta"
+runs 3
+grep -q "Division by zero" "$TMP/watch.err"
+[ "$(wc -c < "$TMP/out.f64")" -eq 16 ]
+kill $pid
+
+# -j has no effect there, so it is refused
+if $ZETA --watch -j 2 "$TMP/prog.zeta" 2> "$TMP/jobs.err"; then exit 1; fi
+grep -q "can't be used" "$TMP/jobs.err"
+
+# A syntax error after a call in the same unit is reported, and watching goes on
+printf 'def f(x) = x\ny = f(1) +\n' > "$TMP/call.zeta"
+: > "$TMP/watch.err"
+$ZETA --watch "$TMP/call.zeta" > /dev/null 2> "$TMP/watch.err" &
+pid=$!
+runs 1
+grep -q "Invalid syntax" "$TMP/watch.err"
+printf 'def f(x) = x\ny = f(1)\n' > "$TMP/call.zeta"
+runs 2
+kill $pid
@@ -1,9 +1,30 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ZETA_X86 1
+#endif
 
 /*
 ###############################################################################
@@ -17,7 +38,7 @@
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
 
-// Maximum amount of Zeta code to interpret
+// Size of the lexer's buffer (longer lines are read in chunks)
 #define CODE_MAX (1024 * 4) 
 
 // reference (just for code clarity)
@@ -29,16 +50,40 @@
 // Represents Any Number
 typedef double Num;
 
+// Catches errors raised on the current thread instead of exiting,
+// so they can be reported later in source order
+typedef struct {
+    jmp_buf env;
+    char message[256];
+} ErrorTrap;
+
+_Thread_local ErrorTrap ptr error_trap = NULL;
+
+// Whether stdout holds text (errors end its line); false when results go there as binary
+bool text_stdout = true;
+
 // Error handling
 void error(const char ptr detail, ...) {
     va_list args;
     va_start(args, detail);
+    if (error_trap) {
+        ErrorTrap ptr trap = error_trap;
+        error_trap = NULL;
+        vsnprintf(trap->message, sizeof(trap->message), detail, args);
+        va_end(args);
+        longjmp(trap->env, 1);
+    }
     vfprintf(stderr, detail, args);
     va_end(args);
-    printf("\n");
+    if (text_stdout) printf("\n");
+    else fputc('\n', stderr);
     exit(EXIT_FAILURE);
 }
 
+#ifdef ZETA_BENCH
+
+// Generic dynamic array the typed ones below replaced, kept as the
+// baseline they are measured against by `make bench`
 typedef struct {
     size_t elCount;  // Number of elements currently in the array
     size_t capacity; // Allocated capacity of the array
@@ -99,6 +144,73 @@ void darray_resize(darray ptr array, size_t newCapacity) {
     array->capacity = newCapacity;
 }
 
+#endif
+
+// Declares a dynamic array of T named Name. The first N elements live inside
+// the struct; the array moves to the heap once it grows past them.
+//   Name_Init()     create an empty array
+//   Name_add()      append an element
+//   Name_get()      read an element (bounds checked)
+//   Name_at()       read an element (unchecked, for loops over 0..elCount)
+//   Name_data()     pointer to the elements
+//   Name_destroy()  free the heap buffer, if any
+#define DARRAY_DEFINE(Name, T, N)                                              \
+typedef struct {                                                               \
+    size_t elCount;  /* Number of elements currently in the array */          \
+    size_t capacity; /* N while inline, else the heap capacity */             \
+    T ptr heap;      /* NULL while the elements fit inline */                 \
+    T small[N];                                                                \
+} Name;                                                                        \
+                                                                               \
+static inline Name Name##_Init(void) {                                         \
+    return (Name){.capacity = N};                                              \
+}                                                                              \
+                                                                               \
+static inline T ptr Name##_data(Name ptr array) {                              \
+    return array->heap ? array->heap : array->small;                           \
+}                                                                              \
+                                                                               \
+static inline void Name##_grow(Name ptr array) {                               \
+    size_t capacity = array->capacity * 2;                                     \
+    T ptr heap = array->heap                                                   \
+        ? realloc(array->heap, capacity * sizeof(T))                           \
+        : malloc(capacity * sizeof(T));                                        \
+    if (!heap) {                                                               \
+        error("Memory allocation failed");                                     \
+    }                                                                          \
+    if (!array->heap) {                                                        \
+        memcpy(heap, array->small, array->elCount * sizeof(T));                \
+    }                                                                          \
+    array->heap = heap;                                                        \
+    array->capacity = capacity;                                                \
+}                                                                              \
+                                                                               \
+static inline void Name##_add(Name ptr array, T element) {                     \
+    if (array->elCount == array->capacity) {                                   \
+        Name##_grow(array);                                                    \
+    }                                                                          \
+    Name##_data(array)[array->elCount++] = element;                            \
+}                                                                              \
+                                                                               \
+static inline T Name##_at(Name ptr array, size_t index) {                      \
+    return Name##_data(array)[index];                                          \
+}                                                                              \
+                                                                               \
+static inline T Name##_get(Name ptr array, size_t index) {                     \
+    if (index >= array->elCount) {                                             \
+        error("Index out of bounds");                                          \
+    }                                                                          \
+    return Name##_data(array)[index];                                          \
+}                                                                              \
+                                                                               \
+static inline void Name##_destroy(Name ptr array) {                            \
+    free(array->heap);                                                         \
+    *array = Name##_Init();                                                    \
+}
+
+DARRAY_DEFINE(SizeArray, size_t, 4)
+DARRAY_DEFINE(IntArray, int, 4)
+
 // Gets the fule/absolute path
 char ptr get_full_path(const char* relative_path) {
     #ifdef _WIN32
@@ -109,7 +221,7 @@ char ptr get_full_path(const char* relative_path) {
             return NULL;
         }
     #else
-        static char full_path[MAX_PATH];
+        static char full_path[PATH_MAX];
         //realpath
         if (realpath(relative_path, full_path) == NULL) {
             perror("Error getting full path");
@@ -140,6 +252,15 @@ typedef enum {
     NUMBER,
     ASSIGN,
     ID, 
+    LBRACE,
+    RBRACE,
+    COMMA,
+    LBRACKET,
+    RBRACKET,
+    REPEAT,
+    WHILE,
+    DEF,
+    MEMO,
     EOL_TOKEN,
     EOF_TOKEN
 } TokenType;
@@ -157,6 +278,15 @@ const char ptr TokenType_ToString(TokenType tokenType) {
         case PLUS: return "PLUS";
         case MINUS: return "MINUS";
         case SEMI: return "SEMI";
+        case LBRACE: return "LBRACE";
+        case RBRACE: return "RBRACE";
+        case COMMA: return "COMMA";
+        case LBRACKET: return "LBRACKET";
+        case RBRACKET: return "RBRACKET";
+        case REPEAT: return "REPEAT";
+        case WHILE: return "WHILE";
+        case DEF: return "DEF";
+        case MEMO: return "MEMO";
         case EOL_TOKEN: return "EOL_TOKEN";
         case EOF_TOKEN: return "EOF_TOKEN";
         default: return "UNKNOWN";
@@ -169,21 +299,156 @@ typedef struct {
     char value[32];
 } Token;
 
+// Character classes (as isspace/isalpha/isdigit in the C locale)
+enum { CHAR_SPACE = 1, CHAR_ALPHA = 2, CHAR_DIGIT = 4, CHAR_ALNUM = CHAR_ALPHA | CHAR_DIGIT };
+
+unsigned char char_class[256];
+
+// Fill char_class (called by CharScanner_Init)
+void char_class_init(void) {
+    char_class[' '] = CHAR_SPACE;
+    for (int c = '\t'; c <= '\r'; c++) char_class[c] = CHAR_SPACE;
+    for (int c = 'a'; c <= 'z'; c++) char_class[c] = CHAR_ALPHA;
+    for (int c = 'A'; c <= 'Z'; c++) char_class[c] = CHAR_ALPHA;
+    for (int c = '0'; c <= '9'; c++) char_class[c] = CHAR_DIGIT;
+}
+
+#define char_is(c, class) (char_class[(unsigned char)(c)] & (class))
+
+// Length of the run of characters of a class at the start of s[0..n)
+typedef size_t (ptr SpanFn)(const char ptr s, size_t n);
+
+// Run finders for one instruction set
+typedef struct {
+    const char ptr name;
+    bool (ptr supported)(void);
+    SpanFn space;
+    SpanFn alnum;
+    SpanFn digit;
+} CharScanner;
+
+size_t span_scalar(const char ptr s, size_t n, unsigned char class) {
+    size_t i = 0;
+    while (i < n && char_is(s[i], class)) i++;
+    return i;
+}
+
+size_t span_space_scalar(const char ptr s, size_t n) { return span_scalar(s, n, CHAR_SPACE); }
+size_t span_alnum_scalar(const char ptr s, size_t n) { return span_scalar(s, n, CHAR_ALNUM); }
+size_t span_digit_scalar(const char ptr s, size_t n) { return span_scalar(s, n, CHAR_DIGIT); }
+bool scalar_supported(void) { return true; }
+
+#ifdef ZETA_X86
+
+// Bytes of v in [lo, lo + count) (unsigned compare via max)
+#define SSE2_IN_RANGE(v, lo, count) \
+    _mm_cmpeq_epi8(_mm_max_epu8(_mm_sub_epi8((v), _mm_set1_epi8(lo)), _mm_set1_epi8((count) - 1)), _mm_set1_epi8((count) - 1))
+#define AVX2_IN_RANGE(v, lo, count) \
+    _mm256_cmpeq_epi8(_mm256_max_epu8(_mm256_sub_epi8((v), _mm256_set1_epi8(lo)), _mm256_set1_epi8((count) - 1)), _mm256_set1_epi8((count) - 1))
+
+#define SSE2_SPACE(v) _mm_or_si128(_mm_cmpeq_epi8((v), _mm_set1_epi8(' ')), SSE2_IN_RANGE(v, '\t', 5))
+#define SSE2_DIGIT(v) SSE2_IN_RANGE(v, '0', 10)
+#define SSE2_ALNUM(v) _mm_or_si128(SSE2_DIGIT(v), SSE2_IN_RANGE(_mm_or_si128((v), _mm_set1_epi8(0x20)), 'a', 26))
+#define AVX2_SPACE(v) _mm256_or_si256(_mm256_cmpeq_epi8((v), _mm256_set1_epi8(' ')), AVX2_IN_RANGE(v, '\t', 5))
+#define AVX2_DIGIT(v) AVX2_IN_RANGE(v, '0', 10)
+#define AVX2_ALNUM(v) _mm256_or_si256(AVX2_DIGIT(v), AVX2_IN_RANGE(_mm256_or_si256((v), _mm256_set1_epi8(0x20)), 'a', 26))
+
+// Classify 16 bytes per step, stopping at the first byte outside the class
+#define SPAN_SSE2(Name, CLASSIFY, class)                                        \
+size_t Name(const char ptr s, size_t n) {                                      \
+    size_t i = 0;                                                              \
+    for (; i + 16 <= n; i += 16) {                                             \
+        __m128i v = _mm_loadu_si128((const __m128i ptr)(s + i));               \
+        unsigned miss = ~(unsigned)_mm_movemask_epi8(CLASSIFY(v)) & 0xFFFFu;   \
+        if (miss) return i + __builtin_ctz(miss);                              \
+    }                                                                          \
+    return i + span_scalar(s + i, n - i, class);                               \
+}
+
+// Same with 32 bytes per step
+#define SPAN_AVX2(Name, CLASSIFY, class)                                       \
+__attribute__((target("avx2")))                                                \
+size_t Name(const char ptr s, size_t n) {                                      \
+    size_t i = 0;                                                              \
+    for (; i + 32 <= n; i += 32) {                                             \
+        __m256i v = _mm256_loadu_si256((const __m256i ptr)(s + i));            \
+        unsigned miss = ~(unsigned)_mm256_movemask_epi8(CLASSIFY(v));          \
+        if (miss) return i + __builtin_ctz(miss);                              \
+    }                                                                          \
+    return i + span_scalar(s + i, n - i, class);                               \
+}
+
+SPAN_SSE2(span_space_sse2, SSE2_SPACE, CHAR_SPACE)
+SPAN_SSE2(span_alnum_sse2, SSE2_ALNUM, CHAR_ALNUM)
+SPAN_SSE2(span_digit_sse2, SSE2_DIGIT, CHAR_DIGIT)
+SPAN_AVX2(span_space_avx2, AVX2_SPACE, CHAR_SPACE)
+SPAN_AVX2(span_alnum_avx2, AVX2_ALNUM, CHAR_ALNUM)
+SPAN_AVX2(span_digit_avx2, AVX2_DIGIT, CHAR_DIGIT)
+
+bool sse2_supported(void) { return __builtin_cpu_supports("sse2"); }
+bool avx2_supported(void) { return __builtin_cpu_supports("avx2"); }
+
+#endif
+
+// Every scanner, slowest first
+const CharScanner char_scanners[] = {
+    {"scalar", scalar_supported, span_space_scalar, span_alnum_scalar, span_digit_scalar},
+#ifdef ZETA_X86
+    {"sse2", sse2_supported, span_space_sse2, span_alnum_sse2, span_digit_sse2},
+    {"avx2", avx2_supported, span_space_avx2, span_alnum_avx2, span_digit_avx2},
+#endif
+};
+
+#define CHAR_SCANNERS (sizeof(char_scanners) / sizeof(char_scanners[0]))
+
+// Scanner used by the lexer (picked once by Lexer_Init)
+const CharScanner ptr char_scanner = ref char_scanners[0];
+
+// Use the fastest scanner this CPU supports
+void CharScanner_Init(void) {
+    char_class_init();
+    for (size_t i = 0; i < CHAR_SCANNERS; i++) {
+        if (char_scanners[i].supported()) {
+            char_scanner = ref char_scanners[i];
+        }
+    }
+}
+
 // Lexer structure
 typedef struct {
     FILE ptr file;
-    char ptr line;
+    char ptr line;      // Current chunk of the current line
     size_t line_len;
     size_t col;
     size_t row;
+    size_t line_base;   // Characters of the current line in earlier chunks
+    long chunk_pos;     // File offset of the current chunk
+    long next_pos;      // File offset after the current chunk
     char current_char;
+    bool seekable;      // Pipes can't go back to a mark: the input after it is recorded
+    bool recording;
+    FILE ptr record;    // Input from the chunk of the last mark on (a temporary file)
+    FILE ptr replay;    // Recorded input read again after a reset, before the file
 } Lexer;
 
+// Saved lexer position (and the token read there) to rewind to
+typedef struct {
+    long chunk_pos;
+    size_t col;
+    size_t row;
+    size_t line_base;
+    Token token;
+} LexerMark;
+
 Lexer Lexer_Init(FILE ptr line);
+void Lexer_Destroy(Lexer ptr lexer);
+bool read_chunk(Lexer ptr lexer);
 void advance(Lexer ptr lexer);
 void skip_whitespace(Lexer ptr lexer);
 Token number(Lexer ptr lexer);
 Token get_next_token(Lexer ptr lexer);
+LexerMark Lexer_Mark(Lexer ptr lexer, Token token);
+Token Lexer_Reset(Lexer ptr lexer, LexerMark ptr mark);
 
 // Create Lexer Type
 Lexer Lexer_Init(FILE ptr file){
@@ -191,23 +456,125 @@ Lexer Lexer_Init(FILE ptr file){
     if (!line) {
         error("Failed to allocate memory for buffer");
     }
-    fgets(line, CODE_MAX, file);
-    return (Lexer){
+    line[0] = '\0';
+    CharScanner_Init();
+    Lexer lexer = {
         .file = file,
         .line = line,
-        .current_char = line[0],
-        .line_len = strlen(line),
         .col = 0,
         .row = 0,
+        .seekable = fseek(file, 0, SEEK_CUR) == 0,
     };
+    read_chunk(ref lexer);
+    lexer.current_char = line[0];
+    return lexer;
+}
+
+// Free the buffers of a lexer (the file is the caller's)
+void Lexer_Destroy(Lexer ptr lexer) {
+    if (lexer->replay) fclose(lexer->replay);
+    if (lexer->record) fclose(lexer->record);
+    free(lexer->line);
+}
+
+// Append the current chunk to the recorded input
+void record_chunk(Lexer ptr lexer) {
+    if (fwrite(lexer->line, 1, lexer->line_len, lexer->record) != lexer->line_len) {
+        error("Failed to record input: %s", strerror(errno));
+    }
+}
+
+// Read the next chunk of input into the buffer (the file is opened in binary
+// mode, so offsets can be tracked without asking the stream)
+bool read_chunk(Lexer ptr lexer) {
+    while (lexer->replay && fgets(lexer->line, CODE_MAX, lexer->replay) == NULL) {
+        fclose(lexer->replay);
+        lexer->replay = NULL;
+    }
+    if (!lexer->replay && fgets(lexer->line, CODE_MAX, lexer->file) == NULL) {
+        return false;
+    }
+    lexer->line_len = strlen(lexer->line);
+    lexer->chunk_pos = lexer->next_pos;
+    lexer->next_pos += lexer->line_len;
+    if (lexer->recording) record_chunk(lexer);
+    return true;
 }
 
 // Advance the colition in the lexer
 void advance(Lexer ptr lexer) {
     lexer->col++;
+    if (lexer->col < lexer->line_len) {
+        lexer->current_char = lexer->line[lexer->col];
+        return;
+    }
+
+    // The line goes on past the buffer: continue with its next chunk
+    size_t len = lexer->line_len;
+    if (len > 0 && lexer->line[len - 1] != '\n' && read_chunk(lexer)) {
+        lexer->line_base += len;
+        lexer->col = 0;
+        lexer->current_char = lexer->line[0];
+        return;
+    }
+    lexer->current_char = '\0';
+}
+
+// Remember the current position. Input that can't seek is recorded from
+// here on, into a temporary file so that memory doesn't grow with the line,
+// and a reset reads it again from there.
+LexerMark Lexer_Mark(Lexer ptr lexer, Token token) {
+    if (!lexer->seekable) {
+        if (lexer->record) fclose(lexer->record);
+        lexer->record = tmpfile();
+        if (!lexer->record) {
+            error("Failed to record input: %s", strerror(errno));
+        }
+        lexer->recording = true;
+        record_chunk(lexer);
+    }
+    return (LexerMark){
+        .chunk_pos = lexer->chunk_pos,
+        .col = lexer->col,
+        .row = lexer->row,
+        .line_base = lexer->line_base,
+        .token = token,
+    };
+}
+
+// Go back to a marked position, returning the token read there. Without
+// seeking, only the last mark can be gone back to.
+Token Lexer_Reset(Lexer ptr lexer, LexerMark ptr mark) {
+    lexer->next_pos = mark->chunk_pos;
+    if (!lexer->seekable) {
+        // The recording is read again, then what an earlier one left unread
+        if (lexer->replay) {
+            size_t length;
+            while ((length = fread(lexer->line, 1, CODE_MAX, lexer->replay)) > 0) {
+                lexer->line_len = length;
+                record_chunk(lexer);
+            }
+            fclose(lexer->replay);
+        }
+        lexer->replay = lexer->record;
+        lexer->record = NULL;
+        lexer->recording = false;
+        if (fflush(lexer->replay) != 0 || fseek(lexer->replay, 0, SEEK_SET) != 0) {
+            error("Failed to rewind input");
+        }
+    } else if (fseek(lexer->file, mark->chunk_pos, SEEK_SET) != 0) {
+        error("Failed to rewind input");
+    }
+    if (!read_chunk(lexer)) {
+        error("Failed to rewind input");
+    }
+    lexer->col = mark->col;
+    lexer->row = mark->row;
+    lexer->line_base = mark->line_base;
     lexer->current_char = (lexer->col < lexer->line_len) 
         ? lexer->line[lexer->col] 
         : '\0';
+    return mark->token;
 }
 
 // Checking for the next char without advancing
@@ -216,9 +583,16 @@ char peek(Lexer ptr lexer, size_t offset) {
     return (next_col < lexer->line_len) ? lexer->line[next_col] : '\0';
 }
 
-// Skip whitespace characters
+// Skip whitespace characters, a whole run of the buffer at a time
 void skip_whitespace(Lexer ptr lexer) {
-    while (lexer->current_char != '\0' && isspace(lexer->current_char)) {
+    while (lexer->current_char != '\0' && char_is(lexer->current_char, CHAR_SPACE)) {
+        lexer->col += char_scanner->space(lexer->line + lexer->col, lexer->line_len - lexer->col);
+        if (lexer->col < lexer->line_len) {
+            lexer->current_char = lexer->line[lexer->col];
+            return;
+        }
+        // The run reaches the end of the buffer: let advance() read on
+        lexer->col--;
         advance(lexer);
     }
 }
@@ -227,16 +601,36 @@ void skip_whitespace(Lexer ptr lexer) {
 Token identifier(Lexer ptr lexer){
     Token token = {.type = ID};
     int i = 0;
-    do
+
+    // Whole name in the buffer: copy it at once
+    size_t len = char_scanner->alnum(lexer->line + lexer->col, lexer->line_len - lexer->col);
+    if (lexer->col + len < lexer->line_len) {
+        if (len > 31) error("Too many characters in variable name");
+        memcpy(token.value, lexer->line + lexer->col, len);
+        lexer->col += len;
+        lexer->current_char = lexer->line[lexer->col];
+        i = (int)len;
+    }
+    else do
     {
         if (i >= 31) error("Too many characters in variable name");
         token.value[i++] = lexer->current_char;
         advance(lexer);
     }
-    while (lexer->current_char != '\0' && isalnum(lexer->current_char));
+    while (lexer->current_char != '\0' && char_is(lexer->current_char, CHAR_ALNUM));
     return token;
 }
 
+// Keyword a name stands for (ID if none). Names are read as IDs: the
+// parser decides where they are keywords, so they remain variable names.
+TokenType keyword_type(const char ptr name) {
+    if (strcmp(name, "repeat") == 0) return REPEAT;
+    if (strcmp(name, "while") == 0) return WHILE;
+    if (strcmp(name, "def") == 0) return DEF;
+    if (strcmp(name, "memo") == 0) return MEMO;
+    return ID;
+}
+
 // Parse number from input
 Token number(Lexer ptr lexer) {
     char result[32];
@@ -244,6 +638,20 @@ Token number(Lexer ptr lexer) {
     bool hasDot = false;
     bool hasE = false;
 
+    // Plain integer in the buffer: copy it at once
+    size_t len = char_scanner->digit(lexer->line + lexer->col, lexer->line_len - lexer->col);
+    size_t end = lexer->col + len;
+    if (len > 0 && len <= 31 && end < lexer->line_len) {
+        char next = lexer->line[end];
+        if (next != '.' && next != 'e' && next != 'E') {
+            Token token = (Token){.type = NUMBER};
+            memcpy(token.value, lexer->line + lexer->col, len);
+            lexer->col = end;
+            lexer->current_char = next;
+            return token;
+        }
+    }
+
     do {
         // Check if we exceed the result buffer
         if (i >= 31) error("Too many digits in the number");
@@ -273,7 +681,7 @@ Token number(Lexer ptr lexer) {
             }
 
             // Ensure there is at least one digit in the exponent
-            if (!isdigit(lexer->current_char)) {
+            if (!char_is(lexer->current_char, CHAR_DIGIT)) {
                 error("'E' or 'e' must be followed by a number");
             }
         }
@@ -282,7 +690,7 @@ Token number(Lexer ptr lexer) {
         result[i++] = lexer->current_char;
         advance(lexer);
     } while (lexer->current_char != '\0' &&
-             (isdigit(lexer->current_char) ||
+             (char_is(lexer->current_char, CHAR_DIGIT) ||
               lexer->current_char == '.' ||
               lexer->current_char == 'E' || lexer->current_char == 'e'));
 
@@ -297,17 +705,17 @@ Token get_next_token(Lexer ptr lexer) {
     while (lexer->current_char != '\n' && lexer->current_char != '\0') {
 
         // Skip whitespace
-        if (isspace(lexer->current_char)) {
+        if (char_is(lexer->current_char, CHAR_SPACE)) {
             skip_whitespace(lexer);
             continue;
         }
         
-        if (isalpha(lexer->current_char)){
+        if (char_is(lexer->current_char, CHAR_ALPHA)){
             return identifier(lexer);
         }
 
         // Number tokens
-        if (isdigit(lexer->current_char) || lexer->current_char == '.') {
+        if (char_is(lexer->current_char, CHAR_DIGIT) || lexer->current_char == '.') {
             return number(lexer);
         }
         
@@ -337,18 +745,34 @@ Token get_next_token(Lexer ptr lexer) {
             case '=': 
                 advance(lexer);
                 return (Token){ASSIGN, "="};
+            case '{': 
+                advance(lexer);
+                return (Token){LBRACE, "{"};
+            case '}': 
+                advance(lexer);
+                return (Token){RBRACE, "}"};
+            case ',': 
+                advance(lexer);
+                return (Token){COMMA, ","};
+            case '[': 
+                advance(lexer);
+                return (Token){LBRACKET, "["};
+            case ']': 
+                advance(lexer);
+                return (Token){RBRACKET, "]"};
             default:
-                error("Invalid character %c at [%zu:%zu]", lexer->current_char, lexer->row, lexer->col);
+                error("Invalid character %c at [%zu:%zu]", lexer->current_char, lexer->row, lexer->line_base + lexer->col);
         }
     }
         
     // Read input
-    if (fgets(lexer->line, CODE_MAX, lexer->file) == NULL) {
+    if (!read_chunk(lexer)) {
         return (Token){EOF_TOKEN, "EOF"};
     }
 
     lexer->row++;
     lexer->col=0;
+    lexer->line_base = 0;
     lexer->current_char = lexer->line[0];
     // End of input
     return (Token){EOL_TOKEN, "EOL"};
@@ -370,24 +794,35 @@ typedef enum  {
     AST_BINOP,
     AST_NUM,
     AST_COMPOUND,
+    AST_REPEAT,
+    AST_WHILE,
+    AST_DEF,
+    AST_CALL,
+    AST_VECTOR,
     AST_NoOp
 }AstType;
 
 // Generic Ast class
 typedef struct Ast Ast;
+DARRAY_DEFINE(AstArray, Ast ptr, 4)
+
 typedef struct Ast
 {
     AstType type;
     union
     {   
-        // For Compound
-        struct {darray ptr childrend;};
+        // For Compound and Vector literals
+        struct {AstArray childrend;};
         // For Unary Operartor
         struct {Ast ptr expr; /*Token op;*/};
         // For Binary and Assign Operators
         struct {Ast ptr left; Token op; Ast ptr right;};
-        // For Numbers and Var
-        struct {Num value; Token token;};
+        // For Numbers and Var (slot: index in the variable table once resolved, else -1)
+        struct {Num value; Token token; int slot;};
+        // For Loops (cond: count for repeat, condition for while; body: Compound of lines)
+        struct {Ast ptr cond; Ast ptr body;};
+        // For Function definitions and calls (args: Compound of parameters or arguments)
+        struct {Ast ptr args; Token name; bool memo; Ast ptr fbody;};
     };
 }Ast;
 
@@ -396,15 +831,125 @@ Ast ptr Ast_Assign_Init(Ast ptr left, Token op, Ast ptr right);
 Ast ptr Ast_BinOp_Init(Ast ptr left, Token op, Ast ptr right);
 Ast ptr Ast_Num_Init(Token num);
 Ast ptr Ast_Unary_Init(Token num, Ast ptr expr);
-Ast ptr Ast_Compound_Init(darray ptr list);
+Ast ptr Ast_Compound_Init(AstArray list);
+Ast ptr Ast_Loop_Init(Token keyword, Ast ptr cond, Ast ptr body);
+Ast ptr Ast_Def_Init(Token keyword, Token name, Ast ptr params, Ast ptr body);
+Ast ptr Ast_Call_Init(Token name, Ast ptr args);
+Ast ptr Ast_Vector_Init(AstArray elements);
+Ast ptr Ast_Clone(Ast ptr node);
 Ast ptr Ast_NoOp_Init();
+void Ast_Destroy(Ast ptr node);
+
+// Nodes alive while --watch runs the file, or while -j parses a batch: after
+// an error they are what is left of the trees being parsed or visited, and
+// are freed. Only the main thread allocates nodes then (-j can't be used
+// with --watch, and its workers run once the batch is parsed).
+typedef struct {
+    Ast ptr ptr slots; // Open addressing, NULL = empty
+    size_t size;       // Power of two; 0 while nodes are not logged
+    size_t count;
+} AstLog;
+
+AstLog ast_log = {0};
+
+size_t ast_log_home(Ast ptr node) {
+    return (size_t)(((uintptr_t)node * 0x9E3779B97F4A7C15ull) >> 20) & (ast_log.size - 1);
+}
+
+void ast_log_insert(Ast ptr node) {
+    if (2 * (ast_log.count + 1) > ast_log.size) {
+        AstLog old = ast_log;
+        ast_log.size *= 2;
+        ast_log.count = 0;
+        ast_log.slots = calloc(ast_log.size, sizeof(Ast ptr));
+        if (!ast_log.slots) {
+            error("Memory allocation failed");
+        }
+        for (size_t i = 0; i < old.size; i++) {
+            if (old.slots[i]) ast_log_insert(old.slots[i]);
+        }
+        free(old.slots);
+    }
+    size_t mask = ast_log.size - 1;
+    size_t i = ast_log_home(node);
+    while (ast_log.slots[i]) i = (i + 1) & mask;
+    ast_log.slots[i] = node;
+    ast_log.count++;
+}
+
+// Remove a node, moving back the ones after it that belong closer to home
+void ast_log_remove(Ast ptr node) {
+    size_t mask = ast_log.size - 1;
+    size_t i = ast_log_home(node);
+    while (ast_log.slots[i] != node) {
+        if (!ast_log.slots[i]) return; // Allocated before the log started
+        i = (i + 1) & mask;
+    }
+    for (size_t j = (i + 1) & mask; ast_log.slots[j]; j = (j + 1) & mask) {
+        size_t home = ast_log_home(ast_log.slots[j]);
+        bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays) {
+            ast_log.slots[i] = ast_log.slots[j];
+            i = j;
+        }
+    }
+    ast_log.slots[i] = NULL;
+    ast_log.count--;
+}
+
+// Log the nodes allocated from now on
+void AstLog_Start(void) {
+    ast_log.size = 1024;
+    ast_log.count = 0;
+    ast_log.slots = calloc(ast_log.size, sizeof(Ast ptr));
+    if (!ast_log.slots) {
+        error("Memory allocation failed");
+    }
+}
+
+// The nodes logged so far belong to something that outlives an error
+void AstLog_Forget(void) {
+    if (ast_log.count == 0) return;
+    memset(ast_log.slots, 0, ast_log.size * sizeof(Ast ptr));
+    ast_log.count = 0;
+}
+
+// Free the nodes still alive and stop logging
+void AstLog_Stop(void) {
+    AstLog log = ast_log;
+    ast_log = (AstLog){0};
+    for (size_t i = 0; i < log.size; i++) {
+        Ast ptr node = log.slots[i];
+        if (!node) continue;
+        // Children are nodes of their own here; only the arrays go with the node
+        if (node->type == AST_COMPOUND || node->type == AST_VECTOR) {
+            AstArray_destroy(ref node->childrend);
+        }
+        free(node);
+    }
+    free(log.slots);
+}
 
+// Allocate a node
+Ast ptr Ast_New(void) {
+    Ast ptr node = malloc(sizeof(Ast));
+    if (!node) {
+        error("Memory allocation failed");
+    }
+    if (ast_log.size) ast_log_insert(node);
+    return node;
+}
 
+// Free a node (not its children)
+void Ast_Free(Ast ptr node) {
+    if (ast_log.size) ast_log_remove(node);
+    free(node);
+}
 
 
 // For creating Ast for Unary Operators
 Ast ptr Ast_Unary_Init(Token num, Ast ptr expr){
-    Ast ptr ast = malloc(sizeof(Ast));
+    Ast ptr ast = Ast_New();
     *ast = (Ast){.type = AST_UNARY, .expr = expr};
     ast->op = num;
     return ast;
@@ -412,47 +957,160 @@ Ast ptr Ast_Unary_Init(Token num, Ast ptr expr){
 
 // For creating Ast for Assign Operators
 Ast ptr Ast_Assign_Init(Ast ptr left, Token op, Ast ptr right){
-    Ast ptr ast = malloc(sizeof(Ast));
+    Ast ptr ast = Ast_New();
     *ast = (Ast){.type = AST_ASSIGN,.left = left, .op = op, .right = right};
     return ast;
 }
 
 // For creating Ast for Variables
 Ast ptr Ast_Var_Init(Token token){
-    Ast ptr ast = malloc(sizeof(Ast));
-    *ast = (Ast){.type = AST_VAR, .token = token};
+    Ast ptr ast = Ast_New();
+    *ast = (Ast){.type = AST_VAR, .token = token, .slot = -1};
     //memcpy(ref ast->token, ref token, sizeof(Token));
     return ast;
 }
 
 // For creating Ast for Binary Operators
 Ast ptr Ast_BinOp_Init(Ast ptr left, Token op, Ast ptr right){
-    Ast ptr ast = malloc(sizeof(Ast));
+    Ast ptr ast = Ast_New();
     *ast = (Ast){.type = AST_BINOP,.left = left, .op = op, .right = right};
     return ast;
 }
 
 // For creating Ast for Numbers
 Ast ptr Ast_Num_Init(Token num){
-    Ast ptr ast = malloc(sizeof(Ast));
+    Ast ptr ast = Ast_New();
     *ast = (Ast){.type = AST_NUM, .token = num, .value = atof(num.value)};
     return ast;
 }
 
 // For creating Ast for No Operations
 Ast ptr Ast_NoOp_Init(){
-    Ast ptr ast = malloc(sizeof(Ast));
+    Ast ptr ast = Ast_New();
     *ast = (Ast){.type = AST_NoOp};
     return ast;
 }
 
-Ast ptr Ast_Compound_Init(darray ptr list){
-    Ast ptr root = malloc(sizeof(Ast));
+Ast ptr Ast_Compound_Init(AstArray list){
+    Ast ptr root = Ast_New();
     root->type = AST_COMPOUND;
     root->childrend = list;    
     return root;
 }
 
+// For creating Ast for Loops
+Ast ptr Ast_Loop_Init(Token keyword, Ast ptr cond, Ast ptr body){
+    Ast ptr ast = Ast_New();
+    *ast = (Ast){.type = keyword.type == REPEAT ? AST_REPEAT : AST_WHILE, .cond = cond, .body = body};
+    return ast;
+}
+
+// For creating Ast for Function definitions
+Ast ptr Ast_Def_Init(Token keyword, Token name, Ast ptr params, Ast ptr body){
+    Ast ptr ast = Ast_New();
+    *ast = (Ast){.type = AST_DEF, .args = params, .name = name, .memo = keyword.type == MEMO, .fbody = body};
+    return ast;
+}
+
+// For creating Ast for Function calls
+Ast ptr Ast_Call_Init(Token name, Ast ptr args){
+    Ast ptr ast = Ast_New();
+    *ast = (Ast){.type = AST_CALL, .args = args, .name = name, .fbody = NULL};
+    return ast;
+}
+
+// For creating Ast for Vector literals
+Ast ptr Ast_Vector_Init(AstArray elements){
+    Ast ptr ast = Ast_New();
+    *ast = (Ast){.type = AST_VECTOR, .childrend = elements};
+    return ast;
+}
+
+// For copying an Ast (visiting frees the nodes, so cached trees are visited through copies)
+Ast ptr Ast_Clone(Ast ptr node){
+    Ast ptr copy = Ast_New();
+    *copy = *node;
+    switch (node->type) {
+        case AST_VAR:
+            copy->slot = -1; // Slots are only valid for the tree they were found for
+            break;
+        case AST_ASSIGN:
+        case AST_BINOP:
+            copy->left = Ast_Clone(node->left);
+            copy->right = Ast_Clone(node->right);
+            break;
+        case AST_UNARY:
+            copy->expr = Ast_Clone(node->expr);
+            break;
+        case AST_REPEAT:
+        case AST_WHILE:
+            copy->cond = Ast_Clone(node->cond);
+            copy->body = Ast_Clone(node->body);
+            break;
+        case AST_DEF:
+        case AST_CALL:
+            copy->args = Ast_Clone(node->args);
+            if (node->fbody) copy->fbody = Ast_Clone(node->fbody);
+            break;
+        case AST_COMPOUND:
+        case AST_VECTOR:
+            copy->childrend = AstArray_Init();
+            for (size_t i = 0; i < node->childrend.elCount; i++) {
+                AstArray_add(ref copy->childrend, Ast_Clone(AstArray_at(ref node->childrend, i)));
+            }
+            break;
+        default:
+            break;
+    }
+    return copy;
+}
+
+// For freeing an Ast that will not be visited
+void Ast_Destroy(Ast ptr node){
+    switch (node->type) {
+        case AST_ASSIGN:
+        case AST_BINOP:
+            Ast_Destroy(node->left);
+            Ast_Destroy(node->right);
+            break;
+        case AST_UNARY:
+            Ast_Destroy(node->expr);
+            break;
+        case AST_REPEAT:
+        case AST_WHILE:
+            Ast_Destroy(node->cond);
+            Ast_Destroy(node->body);
+            break;
+        case AST_DEF:
+        case AST_CALL:
+            Ast_Destroy(node->args);
+            if (node->fbody) Ast_Destroy(node->fbody);
+            break;
+        case AST_COMPOUND:
+        case AST_VECTOR:
+            for (size_t i = 0; i < node->childrend.elCount; i++) {
+                Ast_Destroy(AstArray_at(ref node->childrend, i));
+            }
+            AstArray_destroy(ref node->childrend);
+            break;
+        default:
+            break;
+    }
+    Ast_Free(node);
+}
+
+// Statements a line may hold before it is evaluated while being parsed
+#define STREAM_MIN 256
+
+// Receives each statement of a line as soon as it is parsed
+typedef void (ptr StatementFn)(void ptr ctx, Ast ptr statement);
+
+// Statements of a line collected for one Compound node
+typedef struct {
+    Ast ptr root;
+    bool overflow; // More than STREAM_MIN statements
+} StatementList;
+
 // Parser structure
 typedef struct {
     Lexer ptr lexer;
@@ -466,10 +1124,16 @@ Ast ptr term(Parser ptr parser);
 Ast ptr expr(Parser ptr parser);
 Ast ptr empty(Parser ptr parser);
 Ast ptr variable(Parser ptr parser);
-Ast ptr assignment_statement(Parser ptr parser);
+Ast ptr assignment_statement(Parser ptr parser, Ast ptr left);
+Ast ptr loop_statement(Parser ptr parser, Token keyword);
+Ast ptr function_definition(Parser ptr parser, Token keyword);
+Ast ptr call(Parser ptr parser, Ast ptr name);
+Ast ptr vector(Parser ptr parser);
+Ast ptr block(Parser ptr parser);
 Ast ptr statment(Parser ptr parser);
 Ast ptr compound_statment(Parser ptr parser);
-darray ptr statement_list(Parser ptr parser);
+void line_statements(Parser ptr parser, StatementFn emit, void ptr ctx);
+void statement_list(Parser ptr parser, StatementFn emit, void ptr ctx);
 Ast ptr program(Parser ptr parser);
 Ast ptr parse(Parser ptr parser);
 
@@ -501,7 +1165,7 @@ void eat(Parser ptr parser, unsigned int count, TokenType types[]) {
     }
 }
 
-// Parse factor: NUMBER or (expr)
+// Parse factor: NUMBER, (expr), vector, variable or call
 Ast ptr factor(Parser ptr parser) {
     Token token = parser->current_token;
     if (token.type == MINUS) {
@@ -518,8 +1182,13 @@ Ast ptr factor(Parser ptr parser) {
         Ast ptr node = expr(parser);
         eat(parser, 1, (TokenType[]){RPAREN});
         return node;
+    }else if (token.type == LBRACKET) {
+        return vector(parser);
     }else{
         Ast ptr node = variable(parser);
+        if (parser->current_token.type == LPAREN) {
+            return call(parser, node);
+        }
         return node;
     }
 
@@ -576,6 +1245,38 @@ Ast ptr empty(Parser ptr parser){
     return Ast_NoOp_Init();
 }
 
+// Parse call: variable LPAREN (expr (COMMA expr)*)? RPAREN
+Ast ptr call(Parser ptr parser, Ast ptr name){
+    Ast ptr args = Ast_Compound_Init(AstArray_Init());
+    eat(parser, 1, (TokenType[]){LPAREN});
+    if (parser->current_token.type != RPAREN) {
+        AstArray_add(ref args->childrend, expr(parser));
+        while (parser->current_token.type == COMMA) {
+            eat(parser, 1, (TokenType[]){COMMA});
+            AstArray_add(ref args->childrend, expr(parser));
+        }
+    }
+    eat(parser, 1, (TokenType[]){RPAREN});
+    Ast ptr node = Ast_Call_Init(name->token, args);
+    Ast_Free(name);
+    return node;
+}
+
+// Parse vector: LBRACKET (expr (COMMA expr)*)? RBRACKET
+Ast ptr vector(Parser ptr parser){
+    Ast ptr node = Ast_Vector_Init(AstArray_Init());
+    eat(parser, 1, (TokenType[]){LBRACKET});
+    if (parser->current_token.type != RBRACKET) {
+        AstArray_add(ref node->childrend, expr(parser));
+        while (parser->current_token.type == COMMA) {
+            eat(parser, 1, (TokenType[]){COMMA});
+            AstArray_add(ref node->childrend, expr(parser));
+        }
+    }
+    eat(parser, 1, (TokenType[]){RBRACKET});
+    return node;
+}
+
 // Parse varaible: ((ID))
 Ast ptr variable(Parser ptr parser){
     Ast ptr node = Ast_Var_Init(parser->current_token);
@@ -583,9 +1284,8 @@ Ast ptr variable(Parser ptr parser){
     return node;
 }
 
-// Parse assignment statement: varaible ((ASSIGN) expr)
-Ast ptr assignment_statement(Parser ptr parser){
-    Ast ptr left = variable(parser);
+// Parse assignment statement: varaible ((ASSIGN) expr), the variable parsed already
+Ast ptr assignment_statement(Parser ptr parser, Ast ptr left){
     Token token = parser->current_token;
     eat(parser, 1, (TokenType[]){ASSIGN});
     Ast ptr right = expr(parser);
@@ -593,11 +1293,84 @@ Ast ptr assignment_statement(Parser ptr parser){
     return node;
 }
 
-// Parse statement: (ID | empty)
+// Parse block: ((statment | SEMI | EOL_TOKEN))* until RBRACE, one Compound per line
+Ast ptr block(Parser ptr parser){
+    Ast ptr lines = Ast_Compound_Init(AstArray_Init());
+    Ast ptr line = NULL;
+    for (;;) {
+        TokenType type = parser->current_token.type;
+        if (type == RBRACE || type == EOL_TOKEN || type == EOF_TOKEN) {
+            line = NULL;
+            if (type == RBRACE) break;
+            if (type == EOF_TOKEN) error("Missing '}'");
+            eat(parser, 1, (TokenType[]){EOL_TOKEN});
+        } else if (type == SEMI) {
+            eat(parser, 1, (TokenType[]){SEMI});
+        } else {
+            Ast ptr node = statment(parser);
+            if (node->type == AST_DEF) {
+                Ast_Destroy(node);
+                error("Functions must be defined outside loops");
+            }
+            if (!line) {
+                line = Ast_Compound_Init(AstArray_Init());
+                AstArray_add(ref lines->childrend, line);
+            }
+            AstArray_add(ref line->childrend, node);
+            type = parser->current_token.type;
+            if (type != SEMI && type != EOL_TOKEN && type != RBRACE && type != EOF_TOKEN) {
+                error("Invalid syntax");
+            }
+        }
+    }
+    return lines;
+}
+
+// Parse function definition: (DEF | MEMO) ID LPAREN (ID (COMMA ID)*)? RPAREN ASSIGN expr,
+// the keyword parsed already
+Ast ptr function_definition(Parser ptr parser, Token keyword){
+    Token name = parser->current_token;
+    eat(parser, 1, (TokenType[]){ID});
+    eat(parser, 1, (TokenType[]){LPAREN});
+    Ast ptr params = Ast_Compound_Init(AstArray_Init());
+    if (parser->current_token.type != RPAREN) {
+        AstArray_add(ref params->childrend, variable(parser));
+        while (parser->current_token.type == COMMA) {
+            eat(parser, 1, (TokenType[]){COMMA});
+            AstArray_add(ref params->childrend, variable(parser));
+        }
+    }
+    eat(parser, 1, (TokenType[]){RPAREN});
+    eat(parser, 1, (TokenType[]){ASSIGN});
+    Ast ptr body = expr(parser);
+    return Ast_Def_Init(keyword, name, params, body);
+}
+
+// Parse loop: (REPEAT | WHILE) expr LBRACE block RBRACE, the keyword parsed already
+Ast ptr loop_statement(Parser ptr parser, Token keyword){
+    Ast ptr cond = expr(parser);
+    eat(parser, 1, (TokenType[]){LBRACE});
+    Ast ptr body = block(parser);
+    eat(parser, 1, (TokenType[]){RBRACE});
+    return Ast_Loop_Init(keyword, cond, body);
+}
+
+// Parse statement: (assignment_statement | loop_statement | function_definition | empty).
+// A keyword starts a loop or definition unless it is assigned to.
 Ast ptr statment(Parser ptr parser){
     Ast ptr node;
     if (parser->current_token.type == ID){
-        node = assignment_statement(parser);
+        Token keyword = parser->current_token;
+        keyword.type = keyword_type(keyword.value);
+        Ast ptr left = variable(parser);
+        if (keyword.type == ID || parser->current_token.type == ASSIGN) {
+            node = assignment_statement(parser, left);
+        } else {
+            Ast_Free(left);
+            node = keyword.type == DEF || keyword.type == MEMO
+                ? function_definition(parser, keyword)
+                : loop_statement(parser, keyword);
+        }
     }
     else{
         node = empty(parser);
@@ -606,32 +1379,58 @@ Ast ptr statment(Parser ptr parser){
 }
 
 // Parse statement list: statment ((SEMI) statment)*
-darray ptr statement_list(Parser ptr parser){
+void statement_list(Parser ptr parser, StatementFn emit, void ptr ctx){
     Ast ptr node = statment(parser);
     size_t cur_row = parser->lexer->row;
-    darray ptr results = darray_create(Ast ptr);
-    darray_add(results, ref node);
+    emit(ctx, node);
 
     while (parser->current_token.type == SEMI)
     {
         eat(parser, 1, (TokenType[]){SEMI});
         node = statment(parser);
-        darray_add(results, ref node);
+        emit(ctx, node);
     }
 
-    //Ast ptr n = *(Ast ptr*)darray_get(results, 0); -> debug
     if (parser->current_token.type == ID && cur_row == parser->lexer->row){
         error("Worng place for an ID");
     }
-    return results;
 }
 
-// Parse statement
-Ast ptr compound_statment(Parser ptr parser){
-    Ast ptr root = Ast_Compound_Init(statement_list(parser));
+// Parse the statements of a line, passing each one to emit as soon as it is parsed
+void line_statements(Parser ptr parser, StatementFn emit, void ptr ctx){
+    statement_list(parser, emit, ctx);
     if(parser->current_token.type != ID){
         eat(parser, 2, (TokenType[]){EOL_TOKEN, EOF_TOKEN});
     }
+}
+
+// Add a statement to the line, dropping it once the line is too long to hold
+void collect_statement(void ptr ctx, Ast ptr statement){
+    StatementList ptr lines = ctx;
+    if (lines->root->childrend.elCount < STREAM_MIN) {
+        AstArray_add(ref lines->root->childrend, statement);
+    } else {
+        lines->overflow = true;
+        Ast_Destroy(statement);
+    }
+}
+
+// Parse statement
+// Returns NULL for lines with more than STREAM_MIN statements: the whole line
+// is still checked for errors, then the parser goes back to its start so the
+// caller can evaluate it with line_statements() in constant memory. Such
+// lines are parsed twice; from a pipe, they are recorded in a temporary file.
+Ast ptr compound_statment(Parser ptr parser){
+    LexerMark mark = Lexer_Mark(parser->lexer, parser->current_token);
+    StatementList lines = {.root = Ast_Compound_Init(AstArray_Init())};
+    line_statements(parser, collect_statement, ref lines);
+
+    Ast ptr root = lines.root;
+    if (lines.overflow) {
+        Ast_Destroy(root);
+        parser->current_token = Lexer_Reset(parser->lexer, ref mark);
+        return NULL;
+    }
     return root;
 }
 
@@ -650,237 +1449,3897 @@ Ast ptr parse(Parser ptr parser){
 /*
 ###############################################################################
 #                                                                             #
-#  INTERPRETER                                                                #
+#  VECTORS                                                                    #
 #                                                                             #
 ###############################################################################
 */
 
-// Variable: Pair<String, Num>
-typedef struct {
-    char ptr name;
-    Num value;
-} Variable;
+// A value is a number or a vector. Vectors are shared: every variable,
+// local, stack slot and result holding one is a reference to it, and the
+// last reference to go frees it. A value holding the only reference is a
+// temporary, and operators write their result into its buffer.
+typedef struct Vector Vector;
+
+typedef enum { VALUE_NUM, VALUE_VECTOR } ValueType;
 
-// Varaible List: Vector<Variable>
 typedef struct {
-    Variable ptr vars;
-    int count;
-    int capacity;
-} VariableTable;
+    ValueType type;
+    union {
+        Num num;
+        Vector ptr vector;
+    };
+} Value;
 
-// The Interpretert
-typedef struct 
-{
-    Parser ptr parser;
-    VariableTable vtable;
-}Interpreter;
+// Buffers hold a power of two of elements, at least VECTOR_MIN (so blocks
+// are a multiple of their alignment), and are aligned for the widest loads
+// of the kernels
+#define VECTOR_MIN 8
+#define VECTOR_ALIGN 32
 
-// Chnage the value of a variable in the varaible table
-Num set_variable(Interpreter ptr interpreter, const char ptr name, Num value) {
+// Bytes of released vectors kept for reuse
+#define VECTOR_POOL (64 * 1024 * 1024)
 
-    for (int i = 0; i < interpreter->vtable.count; i++) {
-        if (strcmp(interpreter->vtable.vars[i].name, name) == 0) {
-            interpreter->vtable.vars[i].value = value;
-            return value;
-        }
-    }
+// A vector and its elements are one block (the elements start VECTOR_HEADER
+// bytes in), except for vectors of a state file
+#define VECTOR_HEADER 64
 
-    if (interpreter->vtable.count == interpreter->vtable.capacity) {
-        interpreter->vtable.capacity = interpreter->vtable.capacity ? interpreter->vtable.capacity * 2 : 4;
-        interpreter->vtable.vars = realloc(interpreter->vtable.vars, interpreter->vtable.capacity * sizeof(Variable));
-        if (!interpreter->vtable.vars) {
-            error("Memory allocation failed");
-        }
-    }
+struct Vector {
+    atomic_size_t refs;
+    Num ptr data;
+    size_t length;
+    unsigned char class; // Capacity: 1 << class elements
+    bool mapped;         // data is in a state file (see STATE): never written or freed
+    Vector ptr prev;     // Every vector alive is in vectors.all
+    Vector ptr next;     // (released blocks in the pool: the next one)
+};
 
-    interpreter->vtable.vars[interpreter->vtable.count++] = (Variable){ strdup(name), value };
-    return value;
+// Vectors alive, and the released blocks by class
+typedef struct {
+    pthread_mutex_t lock;
+    Vector ptr all;
+    size_t count;
+    Vector ptr pool[64];
+    size_t pool_bytes;
+} VectorTable;
+
+VectorTable vectors = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static inline Value value_num(Num num) {
+    return (Value){.type = VALUE_NUM, .num = num};
 }
 
-// Get access to a variable in the variable in the variable table
-Num get_variable(Interpreter ptr interpreter, const char ptr name) {
-    for (int i = 0; i < interpreter->vtable.count; i++) {
-        if (strcmp(interpreter->vtable.vars[i].name, name) == 0) {
-            return interpreter->vtable.vars[i].value;
-        }
-    }
-    error("Undefined variable: %s", name);
-    return 0;
+static inline bool is_vector(Value value) {
+    return value.type == VALUE_VECTOR;
 }
 
-// Destroy variable table
-void free_variables(Interpreter ptr interpreter) {
-    for (int i = 0; i < interpreter->vtable.count; i++) {
-        free(interpreter->vtable.vars[i].name);
+// Another reference to a value
+static inline Value value_retain(Value value) {
+    if (value.type == VALUE_VECTOR) {
+        atomic_fetch_add_explicit(ref value.vector->refs, 1, memory_order_relaxed);
     }
-    free(interpreter->vtable.vars);
+    return value;
 }
 
-// Function prototypes for the visitor
+void vector_free(Vector ptr vector);
 
-// Generic vist function
-Num visit(Interpreter ptr interpreter, Ast ptr node);
+// Drop a reference to a value
+static inline void value_release(Value value) {
+    if (value.type == VALUE_VECTOR &&
+        atomic_fetch_sub_explicit(ref value.vector->refs, 1, memory_order_acq_rel) == 1) {
+        vector_free(value.vector);
+    }
+}
 
-// Visit assign operation node
-Num visit_AssignOp(Interpreter ptr interpreter, Ast ptr node) {
-    Num result = set_variable(interpreter, node->left->token.value, visit(interpreter, node->right));
-    free(node);
-    return result;
+// Whether a value is the only reference to a vector it may write to
+static inline bool is_temporary(Value value) {
+    return value.type == VALUE_VECTOR && !value.vector->mapped &&
+           atomic_load_explicit(ref value.vector->refs, memory_order_acquire) == 1;
+}
+
+// Element-wise operators
+typedef enum { VECTOR_ADD, VECTOR_SUB, VECTOR_MUL, VECTOR_DIV } VectorOp;
+
+// out = a op b, a op s and s op b over n elements (out may be a or b)
+typedef void (ptr ArithFn)(Num ptr out, const Num ptr a, const Num ptr b, size_t n);
+typedef void (ptr ArithRightFn)(Num ptr out, const Num ptr a, Num s, size_t n);
+typedef void (ptr ArithLeftFn)(Num ptr out, Num s, const Num ptr b, size_t n);
+typedef Num (ptr ReduceFn)(const Num ptr a, size_t n);
+
+// Kernels for one instruction set
+typedef struct {
+    const char ptr name;
+    bool (ptr supported)(void);
+    ArithFn vv[4];
+    ArithRightFn vs[4];
+    ArithLeftFn sv[4];
+    void (ptr neg)(Num ptr out, const Num ptr a, size_t n);
+    ReduceFn sum;
+    ReduceFn min;
+    ReduceFn max;
+    bool (ptr any_zero)(const Num ptr a, size_t n);
+} VectorKernels;
+
+// Operators on one element
+#define ELEMENT_ADD(a, b) ((a) + (b))
+#define ELEMENT_SUB(a, b) ((a) - (b))
+#define ELEMENT_MUL(a, b) ((a) * (b))
+#define ELEMENT_DIV(a, b) ((a) / (b))
+
+// Reductions keep 4 partial results, element i going to partial i % 4, and
+// combine them pairwise, so every instruction set gives the same result.
+// These finish one from the partials and the elements left from i.
+Num sum_lanes(Num lanes[4], const Num ptr a, size_t i, size_t n) {
+    for (size_t k = 0; i < n; i++, k++) lanes[k] = ELEMENT_ADD(lanes[k], a[i]);
+    return ELEMENT_ADD(ELEMENT_ADD(lanes[0], lanes[1]), ELEMENT_ADD(lanes[2], lanes[3]));
+}
+
+// As minpd/maxpd: the second operand unless the first is smaller (larger).
+// Any NaN makes the result NaN.
+#define LANE_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define LANE_MAX(a, b) ((a) > (b) ? (a) : (b))
+
+Num min_lanes(Num lanes[4], const Num ptr a, size_t i, size_t n, bool nan) {
+    for (size_t k = 0; i < n; i++, k++) {
+        lanes[k] = LANE_MIN(lanes[k], a[i]);
+        nan |= a[i] != a[i];
+    }
+    return nan ? NAN : LANE_MIN(LANE_MIN(lanes[0], lanes[1]), LANE_MIN(lanes[2], lanes[3]));
+}
+
+Num max_lanes(Num lanes[4], const Num ptr a, size_t i, size_t n, bool nan) {
+    for (size_t k = 0; i < n; i++, k++) {
+        lanes[k] = LANE_MAX(lanes[k], a[i]);
+        nan |= a[i] != a[i];
+    }
+    return nan ? NAN : LANE_MAX(LANE_MAX(lanes[0], lanes[1]), LANE_MAX(lanes[2], lanes[3]));
+}
+
+#define ARITH_SCALAR(op, OP)                                                   \
+void vv_##op##_scalar(Num ptr out, const Num ptr a, const Num ptr b, size_t n) { \
+    for (size_t i = 0; i < n; i++) out[i] = OP(a[i], b[i]);                    \
+}                                                                              \
+void vs_##op##_scalar(Num ptr out, const Num ptr a, Num s, size_t n) {         \
+    for (size_t i = 0; i < n; i++) out[i] = OP(a[i], s);                       \
+}                                                                              \
+void sv_##op##_scalar(Num ptr out, Num s, const Num ptr b, size_t n) {         \
+    for (size_t i = 0; i < n; i++) out[i] = OP(s, b[i]);                       \
+}
+
+ARITH_SCALAR(add, ELEMENT_ADD)
+ARITH_SCALAR(sub, ELEMENT_SUB)
+ARITH_SCALAR(mul, ELEMENT_MUL)
+ARITH_SCALAR(div, ELEMENT_DIV)
+
+void neg_scalar(Num ptr out, const Num ptr a, size_t n) {
+    for (size_t i = 0; i < n; i++) out[i] = -a[i];
+}
+
+Num sum_scalar(const Num ptr a, size_t n) {
+    Num lanes[4] = {0, 0, 0, 0};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (int k = 0; k < 4; k++) lanes[k] = ELEMENT_ADD(lanes[k], a[i + k]);
+    }
+    return sum_lanes(lanes, a, i, n);
+}
+
+Num min_scalar(const Num ptr a, size_t n) {
+    Num lanes[4] = {INFINITY, INFINITY, INFINITY, INFINITY};
+    bool nan = false;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (int k = 0; k < 4; k++) {
+            lanes[k] = LANE_MIN(lanes[k], a[i + k]);
+            nan |= a[i + k] != a[i + k];
+        }
+    }
+    return min_lanes(lanes, a, i, n, nan);
+}
+
+Num max_scalar(const Num ptr a, size_t n) {
+    Num lanes[4] = {-INFINITY, -INFINITY, -INFINITY, -INFINITY};
+    bool nan = false;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (int k = 0; k < 4; k++) {
+            lanes[k] = LANE_MAX(lanes[k], a[i + k]);
+            nan |= a[i + k] != a[i + k];
+        }
+    }
+    return max_lanes(lanes, a, i, n, nan);
+}
+
+bool any_zero_scalar(const Num ptr a, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (a[i] == 0) return true;
+    }
+    return false;
+}
+
+#ifdef ZETA_X86
+
+#define SSE2_LOAD _mm_load_pd
+#define SSE2_STORE _mm_store_pd
+#define SSE2_STOREU _mm_storeu_pd
+#define SSE2_SET1 _mm_set1_pd
+#define SSE2_ADD _mm_add_pd
+#define SSE2_SUB _mm_sub_pd
+#define SSE2_MUL _mm_mul_pd
+#define SSE2_DIV _mm_div_pd
+#define SSE2_MIN _mm_min_pd
+#define SSE2_MAX _mm_max_pd
+#define SSE2_OR _mm_or_pd
+#define SSE2_XOR _mm_xor_pd
+#define SSE2_NAN(v) _mm_cmpunord_pd((v), (v))
+#define SSE2_ZERO(v) _mm_cmpeq_pd((v), _mm_setzero_pd())
+#define SSE2_ANY _mm_movemask_pd
+
+#define AVX2_LOAD _mm256_load_pd
+#define AVX2_STORE _mm256_store_pd
+#define AVX2_STOREU _mm256_storeu_pd
+#define AVX2_SET1 _mm256_set1_pd
+#define AVX2_ADD _mm256_add_pd
+#define AVX2_SUB _mm256_sub_pd
+#define AVX2_MUL _mm256_mul_pd
+#define AVX2_DIV _mm256_div_pd
+#define AVX2_MIN _mm256_min_pd
+#define AVX2_MAX _mm256_max_pd
+#define AVX2_OR _mm256_or_pd
+#define AVX2_XOR _mm256_xor_pd
+#define AVX2_NAN(v) _mm256_cmp_pd((v), (v), _CMP_UNORD_Q)
+#define AVX2_ZERO(v) _mm256_cmp_pd((v), _mm256_setzero_pd(), _CMP_EQ_OQ)
+#define AVX2_ANY _mm256_movemask_pd
+
+// Arithmetic kernels of one instruction set, LANES elements per step (the
+// buffers are aligned), the elements left one by one
+#define ARITH_SIMD(op, OP, ISA, isa, ATTR, T, LANES, VOP)                      \
+ATTR void vv_##op##_##isa(Num ptr out, const Num ptr a, const Num ptr b, size_t n) { \
+    size_t i = 0;                                                              \
+    for (; i + LANES <= n; i += LANES) {                                       \
+        ISA##_STORE(out + i, VOP(ISA##_LOAD(a + i), ISA##_LOAD(b + i)));       \
+    }                                                                          \
+    for (; i < n; i++) out[i] = OP(a[i], b[i]);                                \
+}                                                                              \
+ATTR void vs_##op##_##isa(Num ptr out, const Num ptr a, Num s, size_t n) {     \
+    T v = ISA##_SET1(s);                                                       \
+    size_t i = 0;                                                              \
+    for (; i + LANES <= n; i += LANES) {                                       \
+        ISA##_STORE(out + i, VOP(ISA##_LOAD(a + i), v));                       \
+    }                                                                          \
+    for (; i < n; i++) out[i] = OP(a[i], s);                                   \
+}                                                                              \
+ATTR void sv_##op##_##isa(Num ptr out, Num s, const Num ptr b, size_t n) {     \
+    T v = ISA##_SET1(s);                                                       \
+    size_t i = 0;                                                              \
+    for (; i + LANES <= n; i += LANES) {                                       \
+        ISA##_STORE(out + i, VOP(v, ISA##_LOAD(b + i)));                       \
+    }                                                                          \
+    for (; i < n; i++) out[i] = OP(s, b[i]);                                   \
+}
+
+// Negation, reductions and the zero test of one instruction set
+#define VECTOR_SIMD(ISA, isa, ATTR, T, LANES)                                  \
+ARITH_SIMD(add, ELEMENT_ADD, ISA, isa, ATTR, T, LANES, ISA##_ADD)              \
+ARITH_SIMD(sub, ELEMENT_SUB, ISA, isa, ATTR, T, LANES, ISA##_SUB)              \
+ARITH_SIMD(mul, ELEMENT_MUL, ISA, isa, ATTR, T, LANES, ISA##_MUL)              \
+ARITH_SIMD(div, ELEMENT_DIV, ISA, isa, ATTR, T, LANES, ISA##_DIV)              \
+                                                                               \
+ATTR void neg_##isa(Num ptr out, const Num ptr a, size_t n) {                  \
+    T sign = ISA##_SET1(-0.0);                                                 \
+    size_t i = 0;                                                              \
+    for (; i + LANES <= n; i += LANES) {                                       \
+        ISA##_STORE(out + i, ISA##_XOR(ISA##_LOAD(a + i), sign));              \
+    }                                                                          \
+    for (; i < n; i++) out[i] = -a[i];                                         \
+}                                                                              \
+                                                                               \
+ATTR Num sum_##isa(const Num ptr a, size_t n) {                                \
+    T acc[4 / LANES];                                                          \
+    for (int k = 0; k < 4 / LANES; k++) acc[k] = ISA##_SET1(0.0);              \
+    size_t i = 0;                                                              \
+    for (; i + 4 <= n; i += 4) {                                               \
+        for (int k = 0; k < 4 / LANES; k++) {                                  \
+            acc[k] = ISA##_ADD(acc[k], ISA##_LOAD(a + i + k * LANES));         \
+        }                                                                      \
+    }                                                                          \
+    Num lanes[4];                                                              \
+    for (int k = 0; k < 4 / LANES; k++) ISA##_STOREU(lanes + k * LANES, acc[k]); \
+    return sum_lanes(lanes, a, i, n);                                          \
+}                                                                              \
+                                                                               \
+ATTR Num min_##isa(const Num ptr a, size_t n) {                                \
+    T acc[4 / LANES], nan = ISA##_SET1(0.0);                                   \
+    for (int k = 0; k < 4 / LANES; k++) acc[k] = ISA##_SET1(INFINITY);         \
+    size_t i = 0;                                                              \
+    for (; i + 4 <= n; i += 4) {                                               \
+        for (int k = 0; k < 4 / LANES; k++) {                                  \
+            T v = ISA##_LOAD(a + i + k * LANES);                               \
+            acc[k] = ISA##_MIN(acc[k], v);                                     \
+            nan = ISA##_OR(nan, ISA##_NAN(v));                                 \
+        }                                                                      \
+    }                                                                          \
+    Num lanes[4];                                                              \
+    for (int k = 0; k < 4 / LANES; k++) ISA##_STOREU(lanes + k * LANES, acc[k]); \
+    return min_lanes(lanes, a, i, n, ISA##_ANY(nan) != 0);                     \
+}                                                                              \
+                                                                               \
+ATTR Num max_##isa(const Num ptr a, size_t n) {                                \
+    T acc[4 / LANES], nan = ISA##_SET1(0.0);                                   \
+    for (int k = 0; k < 4 / LANES; k++) acc[k] = ISA##_SET1(-INFINITY);        \
+    size_t i = 0;                                                              \
+    for (; i + 4 <= n; i += 4) {                                               \
+        for (int k = 0; k < 4 / LANES; k++) {                                  \
+            T v = ISA##_LOAD(a + i + k * LANES);                               \
+            acc[k] = ISA##_MAX(acc[k], v);                                     \
+            nan = ISA##_OR(nan, ISA##_NAN(v));                                 \
+        }                                                                      \
+    }                                                                          \
+    Num lanes[4];                                                              \
+    for (int k = 0; k < 4 / LANES; k++) ISA##_STOREU(lanes + k * LANES, acc[k]); \
+    return max_lanes(lanes, a, i, n, ISA##_ANY(nan) != 0);                     \
+}                                                                              \
+                                                                               \
+ATTR bool any_zero_##isa(const Num ptr a, size_t n) {                          \
+    size_t i = 0;                                                              \
+    for (; i + LANES <= n; i += LANES) {                                       \
+        if (ISA##_ANY(ISA##_ZERO(ISA##_LOAD(a + i)))) return true;             \
+    }                                                                          \
+    return any_zero_scalar(a + i, n - i);                                      \
+}
+
+VECTOR_SIMD(SSE2, sse2, , __m128d, 2)
+VECTOR_SIMD(AVX2, avx2, __attribute__((target("avx2"))), __m256d, 4)
+
+#endif
+
+#define VECTOR_KERNEL_SET(isa)                                                 \
+    {#isa, isa##_supported,                                                    \
+     {vv_add_##isa, vv_sub_##isa, vv_mul_##isa, vv_div_##isa},                 \
+     {vs_add_##isa, vs_sub_##isa, vs_mul_##isa, vs_div_##isa},                 \
+     {sv_add_##isa, sv_sub_##isa, sv_mul_##isa, sv_div_##isa},                 \
+     neg_##isa, sum_##isa, min_##isa, max_##isa, any_zero_##isa}
+
+// Every kernel set, slowest first
+const VectorKernels vector_kernels[] = {
+    VECTOR_KERNEL_SET(scalar),
+#ifdef ZETA_X86
+    VECTOR_KERNEL_SET(sse2),
+    VECTOR_KERNEL_SET(avx2),
+#endif
+};
+
+#define VECTOR_KERNEL_SETS (sizeof(vector_kernels) / sizeof(vector_kernels[0]))
+
+// Kernels used by the interpreter (picked once by Interpreter_Init)
+const VectorKernels ptr vector_kernel = ref vector_kernels[0];
+
+// Use the fastest kernels this CPU supports
+void VectorKernels_Init(void) {
+    for (size_t i = 0; i < VECTOR_KERNEL_SETS; i++) {
+        if (vector_kernels[i].supported()) {
+            vector_kernel = ref vector_kernels[i];
+        }
+    }
+}
+
+// Free a vector nothing refers to any more, keeping its block for reuse
+// (or giving it back to the system once the pool is full)
+void vector_free(Vector ptr vector) {
+    pthread_mutex_lock(ref vectors.lock);
+    if (vector->prev) vector->prev->next = vector->next;
+    else vectors.all = vector->next;
+    if (vector->next) vector->next->prev = vector->prev;
+    vectors.count--;
+    size_t bytes = VECTOR_HEADER + ((size_t)1 << vector->class) * sizeof(Num);
+    if (vector->mapped || vectors.pool_bytes + bytes > VECTOR_POOL) {
+        free(vector);
+    } else {
+        vector->next = vectors.pool[vector->class];
+        vectors.pool[vector->class] = vector;
+        vectors.pool_bytes += bytes;
+    }
+    pthread_mutex_unlock(ref vectors.lock);
+}
+
+// Add a vector to the ones alive (with the lock held)
+Value vector_link(Vector ptr vector, Num ptr data, size_t length, unsigned char class, bool mapped) {
+    vector->data = data;
+    vector->length = length;
+    vector->class = class;
+    vector->mapped = mapped;
+    atomic_init(ref vector->refs, 1);
+    vector->prev = NULL;
+    vector->next = vectors.all;
+    if (vectors.all) vectors.all->prev = vector;
+    vectors.all = vector;
+    vectors.count++;
+    return (Value){.type = VALUE_VECTOR, .vector = vector};
+}
+
+// Create a vector of length elements (left uninitialized)
+Value vector_new(size_t length) {
+    unsigned char class = 0;
+    while (((size_t)1 << class) < length || ((size_t)1 << class) < VECTOR_MIN) class++;
+    size_t bytes = VECTOR_HEADER + ((size_t)1 << class) * sizeof(Num);
+
+    pthread_mutex_lock(ref vectors.lock);
+    Vector ptr vector = vectors.pool[class];
+    if (vector) {
+        vectors.pool[class] = vector->next;
+        vectors.pool_bytes -= bytes;
+    } else {
+        vector = aligned_alloc(VECTOR_HEADER, bytes);
+        if (!vector) {
+            pthread_mutex_unlock(ref vectors.lock);
+            error("Memory allocation failed");
+        }
+    }
+    Value value = vector_link(vector, (Num ptr)((char ptr)vector + VECTOR_HEADER), length, class, false);
+    pthread_mutex_unlock(ref vectors.lock);
+    return value;
+}
+
+// Create a vector over length elements of a mapped state file (aligned like
+// a buffer). Only temporaries are written in place, so they stay read-only.
+Value vector_map(const Num ptr data, size_t length) {
+    Vector ptr vector = malloc(sizeof(Vector));
+    if (!vector) {
+        error("Memory allocation failed");
+    }
+    pthread_mutex_lock(ref vectors.lock);
+    Value value = vector_link(vector, (Num ptr)data, length, 0, true);
+    pthread_mutex_unlock(ref vectors.lock);
+    return value;
+}
+
+// Free every vector still alive. After an error, temporaries of the
+// statement that failed are left with nothing to release them; once the
+// interpreter is gone, nothing else refers to these.
+void vectors_free_all(void) {
+    while (vectors.all) {
+        vector_free(vectors.all);
+    }
+}
+
+// Create a vector holding count numbers
+Value vector_literal(const Value ptr values, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (is_vector(values[i])) {
+            error("Vector elements must be numbers");
+        }
+    }
+    Value value = vector_new(count);
+    for (size_t i = 0; i < count; i++) {
+        value.vector->data[i] = values[i].num;
+    }
+    return value;
+}
+
+// Apply an arithmetic operator element by element, a number operand being
+// used for every element. Takes over both operands: a temporary one gets
+// the result, the other is released.
+Value vector_binop(TokenType op, Value left, Value right) {
+    bool lv = is_vector(left), rv = is_vector(right);
+    Vector ptr a = lv ? left.vector : NULL;
+    Vector ptr b = rv ? right.vector : NULL;
+    if (lv && rv && a->length != b->length) {
+        error("Vector lengths differ: %zu and %zu", a->length, b->length);
+    }
+    if (op == DIV && rv && vector_kernel->any_zero(b->data, b->length)) {
+        error("Division by zero");
+    }
+    if (op == DIV && !rv && right.num == 0) {
+        error("Division by zero");
+    }
+    VectorOp kind = op == PLUS ? VECTOR_ADD : op == MINUS ? VECTOR_SUB : op == MUL ? VECTOR_MUL : VECTOR_DIV;
+    size_t length = lv ? a->length : b->length;
+
+    Value result;
+    if (is_temporary(left)) {
+        result = left;
+    } else if (is_temporary(right)) {
+        result = right;
+    } else {
+        result = vector_new(length);
+    }
+    Num ptr out = result.vector->data;
+
+    if (lv && rv) {
+        vector_kernel->vv[kind](out, a->data, b->data, length);
+    } else if (lv) {
+        vector_kernel->vs[kind](out, a->data, right.num, length);
+    } else {
+        vector_kernel->sv[kind](out, left.num, b->data, length);
+    }
+    if (result.vector != a) value_release(left);
+    if (result.vector != b) value_release(right);
+    return result;
+}
+
+// Negate a vector element by element (in place if it is a temporary)
+Value vector_negate(Value value) {
+    Vector ptr a = value.vector;
+    Value result = is_temporary(value) ? value : vector_new(a->length);
+    vector_kernel->neg(result.vector->data, a->data, a->length);
+    if (result.vector != a) value_release(value);
+    return result;
+}
+
+// Functions built into the language (a number counts as a vector of one)
+typedef enum { BUILTIN_SUM, BUILTIN_MIN, BUILTIN_MAX, BUILTIN_LEN, BUILTINS } Builtin;
+
+const char ptr builtin_names[BUILTINS] = {"sum", "min", "max", "len"};
+
+// Find a built-in function by name (-1 if there is none)
+int find_builtin(const char ptr name) {
+    for (int i = 0; i < BUILTINS; i++) {
+        if (strcmp(builtin_names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+// Check the arguments of a call of a built-in function (all take one)
+void check_builtin_call(Ast ptr node) {
+    if (node->args->childrend.elCount != 1) {
+        error("Function %s takes 1 argument", node->name.value);
+    }
+}
+
+// Apply a built-in function (the argument is left to the caller)
+Num call_builtin(int builtin, Value arg) {
+    const Num ptr data = ref arg.num;
+    size_t length = 1;
+    if (is_vector(arg)) {
+        data = arg.vector->data;
+        length = arg.vector->length;
+    }
+    switch (builtin) {
+        case BUILTIN_SUM:
+            return vector_kernel->sum(data, length);
+        case BUILTIN_MIN:
+        case BUILTIN_MAX:
+            if (length == 0) {
+                error("%s of an empty vector", builtin_names[builtin]);
+            }
+            return builtin == BUILTIN_MIN ? vector_kernel->min(data, length) : vector_kernel->max(data, length);
+        default:
+            return (Num)length;
+    }
+}
+
+/*
+###############################################################################
+#                                                                             #
+#  OUTPUT                                                                     #
+#                                                                             #
+###############################################################################
+*/
+
+// Formats results can be written in
+typedef enum {
+    OUTPUT_TEXT,    // "%g " per result and a newline per line (printf)
+    OUTPUT_RAW,     // Little-endian doubles, nothing between lines
+    OUTPUT_RECORDS, // Per line: little-endian uint32 count, then that many doubles
+    OUTPUT_COLUMNS, // A directory with one file of raw doubles per assigned variable
+} OutputFormat;
+
+// Size of the output buffer (bytes)
+#define OUTPUT_BUFFER (1024 * 1024)
+
+// Largest buffer of a column (they start small and double on each flush)
+#define COLUMN_BUFFER (64 * 1024)
+
+DARRAY_DEFINE(NumArray, Num, 16)
+
+// Values of one variable, written to <dir>/<name>.f64
+typedef struct {
+    char name[32];
+    unsigned char ptr buffer;
+    size_t used;
+    size_t capacity;
+    bool created;  // The file was truncated by the first flush
+} Column;
+
+// Where results go
+typedef struct {
+    OutputFormat format;
+    int fd;
+    unsigned char ptr buffer;
+    size_t used;
+    NumArray line;       // Results of the current line (records)
+    const char ptr path; // File given with -o (NULL for stdout)
+    const char ptr dir;  // Directory of the columns
+    Column ptr columns;
+    size_t column_count;
+    int ptr index;       // Open addressing on column names: column + 1 (0 = empty)
+    size_t index_size;
+} Output;
+
+Output output = {.format = OUTPUT_TEXT, .fd = STDOUT_FILENO};
+
+// Write all of data to fd (false, with errno set, if that fails)
+bool write_all(int fd, const void ptr data, size_t size) {
+    const char ptr bytes = data;
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        bytes += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+// Report a failed write
+void output_failed(void) {
+    output.format = OUTPUT_TEXT; // Nothing left to flush at exit
+    error("Failed to write output: %s", strerror(errno));
+}
+
+// Store a double as 8 little-endian bytes
+void put_le64(unsigned char ptr out, Num value) {
+    uint64_t bits;
+    memcpy(ref bits, ref value, sizeof(bits));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    bits = __builtin_bswap64(bits);
+#endif
+    memcpy(out, ref bits, sizeof(bits));
+}
+
+// Append bytes to the output buffer, writing it out when full (false if that fails)
+bool output_bytes(const void ptr data, size_t size) {
+    if (output.used + size > OUTPUT_BUFFER) {
+        bool written = write_all(output.fd, output.buffer, output.used);
+        output.used = 0;
+        if (!written) return false;
+        if (size > OUTPUT_BUFFER) {
+            return write_all(output.fd, data, size);
+        }
+    }
+    memcpy(output.buffer + output.used, data, size);
+    output.used += size;
+    return true;
+}
+
+// Write the buffer of a column to the end of its file (false if that fails)
+bool column_flush(Column ptr column) {
+    if (column->used == 0 && column->created) return true;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s.f64", output.dir, column->name);
+    int fd = open(path, O_WRONLY | O_CREAT | (column->created ? O_APPEND : O_TRUNC), 0644);
+    if (fd < 0) return false;
+    bool written = write_all(fd, column->buffer, column->used);
+    close(fd);
+    column->used = 0;
+    column->created = true;
+    return written;
+}
+
+// Remove the column files of earlier runs from the output directory
+void remove_columns(const char ptr dir) {
+    DIR ptr entries = opendir(dir);
+    if (!entries) {
+        error("Cannot open '%s': %s", dir, strerror(errno));
+    }
+    struct dirent ptr entry;
+    while ((entry = readdir(entries)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len > 4 && strcmp(entry->d_name + len - 4, ".f64") == 0) {
+            unlinkat(dirfd(entries), entry->d_name, 0);
+        }
+    }
+    closedir(entries);
+}
+
+// Find or add the column of a variable
+Column ptr output_column(const char ptr name) {
+    size_t hash = 5381;
+    for (const char ptr c = name; *c; c++) hash = hash * 33 + (unsigned char)*c;
+
+    size_t mask = output.index_size - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        int slot = output.index[i];
+        if (slot == 0) {
+            // New column; keep the index at most half full
+            if (2 * (output.column_count + 1) > output.index_size) {
+                int ptr old = output.index;
+                size_t old_size = output.index_size;
+                output.index_size *= 2;
+                output.index = calloc(output.index_size, sizeof(int));
+                output.columns = realloc(output.columns, output.index_size / 2 * sizeof(Column));
+                if (!output.index || !output.columns) {
+                    error("Memory allocation failed");
+                }
+                for (size_t j = 0; j < old_size; j++) {
+                    if (!old[j]) continue;
+                    size_t h = 5381;
+                    for (const char ptr c = output.columns[old[j] - 1].name; *c; c++) h = h * 33 + (unsigned char)*c;
+                    size_t k = h & (output.index_size - 1);
+                    while (output.index[k]) k = (k + 1) & (output.index_size - 1);
+                    output.index[k] = old[j];
+                }
+                free(old);
+                return output_column(name);
+            }
+            Column ptr column = ref output.columns[output.column_count++];
+            *column = (Column){.capacity = 4096};
+            strcpy(column->name, name);
+            column->buffer = malloc(column->capacity);
+            if (!column->buffer) {
+                error("Memory allocation failed");
+            }
+            output.index[i] = (int)output.column_count;
+            return column;
+        }
+        if (strcmp(output.columns[slot - 1].name, name) == 0) {
+            return ref output.columns[slot - 1];
+        }
+    }
+}
+
+bool output_record(void);
+
+// Write out everything buffered (false, with errno set, if that fails)
+bool output_flush(void) {
+    bool written = true;
+    switch (output.format) {
+        case OUTPUT_TEXT:
+            return fflush(stdout) == 0;
+        case OUTPUT_RECORDS:
+            // An error stopped the line: keep its results like text does
+            if (output.line.elCount > 0 && !output_record()) return false;
+            // fallthrough
+        case OUTPUT_RAW:
+            written = write_all(output.fd, output.buffer, output.used);
+            output.used = 0;
+            break;
+        case OUTPUT_COLUMNS:
+            for (size_t i = 0; i < output.column_count; i++) {
+                written = column_flush(ref output.columns[i]) && written;
+            }
+            break;
+    }
+    return written;
+}
+
+// Flush at exit, so errors keep earlier results. exit() can't run again
+// from here, so a failed write ends the process with _exit
+void Output_Flush(void) {
+    if (output_flush()) return;
+    fprintf(stderr, "Failed to write output: %s\n", strerror(errno));
+    _exit(EXIT_FAILURE);
+}
+
+// Send results to path (a directory for columns; NULL for stdout) in a format
+void Output_Init(OutputFormat format, const char ptr path) {
+    output.format = format;
+    output.path = format == OUTPUT_COLUMNS ? NULL : path;
+    if (format == OUTPUT_TEXT) {
+        if (path && !freopen(path, "w", stdout)) {
+            error("Cannot open '%s': %s", path, strerror(errno));
+        }
+        return;
+    }
+
+    if (format == OUTPUT_COLUMNS) {
+        if (!path) {
+            error("The columns format needs an output directory (-o dir)");
+        }
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            error("Cannot create '%s': %s", path, strerror(errno));
+        }
+        remove_columns(path);
+        output.dir = path;
+        output.index_size = 64;
+        output.index = calloc(output.index_size, sizeof(int));
+        output.columns = malloc(output.index_size / 2 * sizeof(Column));
+        if (!output.index || !output.columns) {
+            error("Memory allocation failed");
+        }
+    } else {
+        if (path) {
+            output.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (output.fd < 0) {
+                error("Cannot open '%s': %s", path, strerror(errno));
+            }
+        }
+        text_stdout = false; // Errors end their own line, on stderr
+        output.buffer = malloc(OUTPUT_BUFFER);
+        output.line = NumArray_Init();
+        if (!output.buffer) {
+            error("Memory allocation failed");
+        }
+    }
+    atexit(Output_Flush);
+}
+
+// Start the output over for another run (--watch): the output file is
+// emptied (stdout, devices and pipes just go on) and the columns removed
+void Output_Reset(void) {
+    if (output.format == OUTPUT_COLUMNS) {
+        for (size_t i = 0; i < output.column_count; i++) {
+            free(output.columns[i].buffer);
+        }
+        output.column_count = 0;
+        memset(output.index, 0, output.index_size * sizeof(int));
+        remove_columns(output.dir);
+        return;
+    }
+    output.used = 0;
+    output.line.elCount = 0;
+    if (!output.path) return;
+    if (output.format == OUTPUT_TEXT) {
+        fflush(stdout);
+        if (ftruncate(fileno(stdout), 0) == 0) rewind(stdout);
+    } else if (ftruncate(output.fd, 0) == 0) {
+        lseek(output.fd, 0, SEEK_SET);
+    }
+}
+
+// Write one number
+void output_number(const char ptr name, Num value) {
+    unsigned char bytes[8];
+    switch (output.format) {
+        case OUTPUT_TEXT:
+            printf("%g ", value);
+            break;
+        case OUTPUT_RAW:
+            put_le64(bytes, value);
+            if (!output_bytes(bytes, sizeof(bytes))) output_failed();
+            break;
+        case OUTPUT_RECORDS:
+            NumArray_add(ref output.line, value);
+            break;
+        case OUTPUT_COLUMNS: {
+            Column ptr column = output_column(name);
+            if (column->used + 8 > column->capacity) {
+                if (!column_flush(column)) output_failed();
+                if (column->capacity < COLUMN_BUFFER) {
+                    column->capacity *= 2;
+                    column->buffer = realloc(column->buffer, column->capacity);
+                    if (!column->buffer) {
+                        error("Memory allocation failed");
+                    }
+                }
+            }
+            put_le64(column->buffer + column->used, value);
+            column->used += 8;
+            break;
+        }
+    }
+}
+
+// Write a vector: "[a, b, ...]" in text, its elements one after the
+// other in the binary formats
+void output_vector(const char ptr name, const Vector ptr vector) {
+    if (output.format != OUTPUT_TEXT) {
+        for (size_t i = 0; i < vector->length; i++) {
+            output_number(name, vector->data[i]);
+        }
+        return;
+    }
+    printf("[");
+    for (size_t i = 0; i < vector->length; i++) {
+        printf(i ? ", %g" : "%g", vector->data[i]);
+    }
+    printf("] ");
+}
+
+// Write one statement result
+void output_result(const char ptr name, Value value) {
+    if (is_vector(value)) {
+        output_vector(name, value.vector);
+    } else {
+        output_number(name, value.num);
+    }
+}
+
+// Append the record of the current line (false if a write fails)
+bool output_record(void) {
+    uint32_t count = (uint32_t)output.line.elCount;
+    unsigned char header[4] = {count, count >> 8, count >> 16, count >> 24};
+    output.line.elCount = 0;
+    if (!output_bytes(header, sizeof(header))) return false;
+    Num ptr values = NumArray_data(ref output.line);
+    for (size_t i = 0; i < count; i++) {
+        unsigned char bytes[8];
+        put_le64(bytes, values[i]);
+        if (!output_bytes(bytes, sizeof(bytes))) return false;
+    }
+    return true;
+}
+
+// End a line that had results
+void output_end_line(void) {
+    switch (output.format) {
+        case OUTPUT_TEXT:
+            printf("\n");
+            break;
+        case OUTPUT_RECORDS:
+            if (!output_record()) output_failed();
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+###############################################################################
+#                                                                             #
+#  INTERPRETER                                                                #
+#                                                                             #
+###############################################################################
+*/
+
+// Variable: Pair<String, Value>
+typedef struct {
+    char ptr name;
+    Value value;
+    bool reserved; // Slot made for a -j batch before the variable is assigned
+} Variable;
+
+// Varaible List: Vector<Variable>
+typedef struct {
+    Variable ptr vars;
+    int count;
+    int capacity;
+    int mapped;        // The first names point into the state file (see STATE)
+} VariableTable;
+
+// Compiled function and loop (see COMPILER)
+typedef struct Function Function;
+typedef struct Program Program;
+void Function_Destroy(Function ptr fn);
+void Program_Destroy(Program ptr program);
+
+// Function List: Vector<Function>
+typedef struct {
+    Function ptr ptr funcs;
+    int count;
+    int capacity;
+} FunctionTable;
+
+// The Interpretert
+typedef struct 
+{
+    Parser ptr parser;
+    VariableTable vtable;
+    FunctionTable ftable;
+    bool nl; // Results were printed on the current output line
+    // Loop being run and function being defined, left to Interpreter_Destroy by an error
+    Program ptr loop;
+    Function ptr defining;
+}Interpreter;
+
+// Chnage the value of a variable in the varaible table (the variable takes
+// over the reference)
+Value set_variable(Interpreter ptr interpreter, const char ptr name, Value value) {
+
+    for (int i = 0; i < interpreter->vtable.count; i++) {
+        if (strcmp(interpreter->vtable.vars[i].name, name) == 0) {
+            value_release(interpreter->vtable.vars[i].value);
+            interpreter->vtable.vars[i].value = value;
+            interpreter->vtable.vars[i].reserved = false;
+            return value;
+        }
+    }
+
+    if (interpreter->vtable.count == interpreter->vtable.capacity) {
+        interpreter->vtable.capacity = interpreter->vtable.capacity ? interpreter->vtable.capacity * 2 : 4;
+        interpreter->vtable.vars = realloc(interpreter->vtable.vars, interpreter->vtable.capacity * sizeof(Variable));
+        if (!interpreter->vtable.vars) {
+            error("Memory allocation failed");
+        }
+    }
+
+    interpreter->vtable.vars[interpreter->vtable.count++] = (Variable){.name = strdup(name), .value = value};
+    return value;
+}
+
+// Find the index of a variable in the variable table (-1 if undefined)
+int find_variable(Interpreter ptr interpreter, const char ptr name) {
+    for (int i = 0; i < interpreter->vtable.count; i++) {
+        if (strcmp(interpreter->vtable.vars[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Get access to a variable in the variable in the variable table
+Value get_variable(Interpreter ptr interpreter, const char ptr name) {
+    for (int i = 0; i < interpreter->vtable.count; i++) {
+        if (strcmp(interpreter->vtable.vars[i].name, name) == 0) {
+            if (interpreter->vtable.vars[i].reserved) break;
+            return interpreter->vtable.vars[i].value;
+        }
+    }
+    error("Undefined variable: %s", name);
+    return value_num(0);
+}
+
+// Destroy variable table
+void free_variables(Interpreter ptr interpreter) {
+    for (int i = 0; i < interpreter->vtable.count; i++) {
+        value_release(interpreter->vtable.vars[i].value);
+    }
+    for (int i = interpreter->vtable.mapped; i < interpreter->vtable.count; i++) {
+        free(interpreter->vtable.vars[i].name);
+    }
+    free(interpreter->vtable.vars);
+}
+
+// Header of a frame on the heap (values a visit or a program works on). The
+// frames a thread has open are listed, so that after an error the trap that
+// caught it can free them.
+typedef union HeapFrame {
+    union HeapFrame ptr next;
+    max_align_t align;
+} HeapFrame;
+
+_Thread_local HeapFrame ptr heap_frames = NULL;
+
+// Allocate a zeroed frame of size bytes
+void ptr frame_alloc(size_t size) {
+    HeapFrame ptr frame = calloc(1, sizeof(HeapFrame) + size);
+    if (!frame) {
+        error("Memory allocation failed");
+    }
+    frame->next = heap_frames;
+    heap_frames = frame;
+    return frame + 1;
+}
+
+// Free the frame allocated last
+void frame_free(void ptr data) {
+    HeapFrame ptr frame = (HeapFrame ptr)data - 1;
+    heap_frames = frame->next;
+    free(frame);
+}
+
+// Free the frames an error left open on this thread
+void frames_free_all(void) {
+    while (heap_frames) {
+        HeapFrame ptr frame = heap_frames;
+        heap_frames = frame->next;
+        free(frame);
+    }
+}
+
+// Function prototypes for the visitor
+
+// Generic vist function (the caller gets a reference to the value)
+Value visit(Interpreter ptr interpreter, Ast ptr node);
+
+// Visit loop node (compiles the loop, see COMPILER)
+void visit_Loop(Interpreter ptr interpreter, Ast ptr node);
+
+// Visit function definition and call nodes (see COMPILER)
+void visit_Def(Interpreter ptr interpreter, Ast ptr node);
+Value visit_Call(Interpreter ptr interpreter, Ast ptr node);
+
+// Visit assign operation node
+Value visit_AssignOp(Interpreter ptr interpreter, Ast ptr node) {
+    Value result = visit(interpreter, node->right);
+    if (node->left->slot >= 0) {
+        Variable ptr var = ref interpreter->vtable.vars[node->left->slot];
+        value_release(var->value);
+        var->value = result;
+        var->reserved = false;
+    } else {
+        set_variable(interpreter, node->left->token.value, result);
+    }
+    Ast_Free(node->left);
+    Ast_Free(node);
+    return value_retain(result);
 }
 
 // Visit unary operation node
-Num visit_UnaryOp(Interpreter ptr self, Ast ptr node) {
+Value visit_UnaryOp(Interpreter ptr self, Ast ptr node) {
     TokenType op = node->op.type;
+    Value result = visit(self, node->expr);
+    if (op == MINUS){
+        if (is_vector(result)) {
+            result = vector_negate(result);
+        } else {
+            result.num = -result.num;
+        }
+    }
+    Ast_Free(node);
+    return result;
+}
+
+// Visit binary operation node
+Value visit_BinOp(Interpreter ptr interpreter, Ast ptr node) {
+    Value left_value = visit(interpreter, node->left);
+    Value right_value = visit(interpreter, node->right);
+    if (is_vector(left_value) || is_vector(right_value)) {
+        TokenType op = node->op.type;
+        Ast_Free(node);
+        return vector_binop(op, left_value, right_value);
+    }
+    Num left = left_value.num;
+    Num right = right_value.num;
     Num result;
-    if (op == PLUS){
-        result = +visit(self, node->expr);
-    }else if(op == MINUS){
-        result = -visit(self, node->expr);
+    switch (node->op.type) {
+        case PLUS:
+            result = left + right;
+            break;
+        case MINUS:
+            result = left - right;
+            break;
+        case MUL:
+            result = left * right;
+            break;
+        case DIV:
+            if (right == 0) {
+                error("Division by zero");
+            }
+            result = left / right;
+            break;
+        default:
+            Ast_Free(node);
+            error("Unknown operator");
+            break;
+    }
+    Ast_Free(node);
+    return value_num(result);
+}
+
+// Visit number node
+Value visit_Num(Interpreter ptr interpreter, Ast ptr node) {
+    (void)interpreter;
+    Num num =  node->value;
+    Ast_Free(node);
+    return value_num(num);
+}
+
+// Visit variable node
+Value visit_Var(Interpreter ptr interpreter, Ast ptr node) {
+    Value value;
+    if (node->slot >= 0 && !interpreter->vtable.vars[node->slot].reserved) {
+        value = interpreter->vtable.vars[node->slot].value;
+    } else {
+        value = get_variable(interpreter, node->token.value);
+    }
+    Ast_Free(node);
+    return value_retain(value);
+}
+
+// Visit vector literal node: the elements are evaluated, then checked like
+// compiled code does
+Value visit_Vector(Interpreter ptr interpreter, Ast ptr node) {
+    AstArray ptr elements = ref node->childrend;
+    size_t count = elements->elCount;
+    Value small[8];
+    Value ptr values = count <= 8 ? small : frame_alloc(count * sizeof(Value));
+    for (size_t i = 0; i < count; i++) {
+        values[i] = visit(interpreter, AstArray_at(elements, i));
+    }
+    Value value = vector_literal(values, count);
+    if (values != small) frame_free(values);
+    AstArray_destroy(elements);
+    Ast_Free(node);
+    return value;
+}
+
+// Print the result of an assignment to name
+void print_result(Interpreter ptr interpreter, const char ptr name, Value value){
+    output_result(name, value);
+    interpreter->nl = true;
+}
+
+// End the output line if results were printed on it
+void end_output_line(Interpreter ptr interpreter){
+    if (interpreter->nl) output_end_line();
+    interpreter->nl = false;
+}
+
+// Vist compount node
+void visit_Compound(Interpreter ptr interpreter, Ast ptr node){
+    for (size_t i = 0; i < node->childrend.elCount; i++)
+    {
+        Ast ptr statement = AstArray_at(ref node->childrend, i);
+        if(statement->type == AST_ASSIGN){
+            Token name = statement->left->token; // visit() frees the node
+            Value value = visit(interpreter, statement);
+            print_result(interpreter, name.value, value);
+            value_release(value);
+        } else {
+            visit(interpreter, statement);
+        }
+    }
+    end_output_line(interpreter);
+    AstArray_destroy(ref node->childrend);
+    Ast_Free(node);
+}
+
+// Vist no operation node
+void visit_NoOp(Interpreter ptr interpreter, Ast ptr node){
+    (void)interpreter; // nothing
+    Ast_Free(node);
+}
+
+// Generic visit function
+Value visit(Interpreter ptr interpreter, Ast ptr node) {
+    switch (node->type) {
+        case AST_ASSIGN:
+            return visit_AssignOp(interpreter, node);
+        case AST_UNARY:
+            return visit_UnaryOp(interpreter, node);
+        case AST_BINOP:
+            return visit_BinOp(interpreter, node);
+        case AST_NUM:
+            return visit_Num(interpreter, node);
+        case AST_VAR:
+            return visit_Var(interpreter, node);
+        case AST_CALL:
+            return visit_Call(interpreter, node);
+        case AST_VECTOR:
+            return visit_Vector(interpreter, node);
+        case AST_DEF:
+            visit_Def(interpreter, node);
+            break;
+        case AST_COMPOUND:
+            visit_Compound(interpreter, node);
+            break;
+        case AST_REPEAT:
+        case AST_WHILE:
+            visit_Loop(interpreter, node);
+            break;
+        case AST_NoOp:
+            visit_NoOp(interpreter, node);
+            break;
+        default:
+            error("No visit function for this node type");
+    }
+    return value_num(-1); // <- will never reach
+}
+
+// Interpreter initialization
+Interpreter Interpreter_Init(Parser ptr parser) {
+    VectorKernels_Init();
+    return (Interpreter){
+        .parser = parser
+    };
+}
+
+// Free the variables and functions of an interpreter
+void Interpreter_Destroy(Interpreter ptr interpreter) {
+    free_variables(interpreter);
+    for (int i = 0; i < interpreter->ftable.count; i++) {
+        Function_Destroy(interpreter->ftable.funcs[i]);
+    }
+    free(interpreter->ftable.funcs);
+    if (interpreter->loop) {
+        Program_Destroy(interpreter->loop);
+        free(interpreter->loop);
+    }
+    if (interpreter->defining) Function_Destroy(interpreter->defining);
+    interpreter->loop = NULL;
+    interpreter->defining = NULL;
+    interpreter->vtable = (VariableTable){0};
+    interpreter->ftable = (FunctionTable){0};
+}
+
+// Evaluate and print a statement as soon as it is parsed (like visit_Compound)
+void visit_Streamed(void ptr ctx, Ast ptr statement){
+    Interpreter ptr interpreter = ctx;
+    if(statement->type == AST_ASSIGN){
+        Token name = statement->left->token; // visit() frees the node
+        Value value = visit(interpreter, statement);
+        print_result(interpreter, name.value, value);
+        value_release(value);
+    } else {
+        visit(interpreter, statement);
+    }
+}
+
+// Evaluate a long line statement by statement, releasing each one before parsing the next
+void interpret_stream(Interpreter ptr interpreter) {
+    line_statements(interpreter->parser, visit_Streamed, interpreter);
+    end_output_line(interpreter);
+}
+
+// Main interpret function
+void interpret(Interpreter ptr interpreter) {
+    while (interpreter->parser->current_token.type != EOF_TOKEN) 
+    {
+        Ast ptr tree = parse(interpreter->parser);
+        if (tree) {
+            visit(interpreter, tree);
+        } else {
+            interpret_stream(interpreter);
+        }
+    }
+}
+
+/*
+###############################################################################
+#                                                                             #
+#  COMPILER                                                                   #
+#                                                                             #
+###############################################################################
+*/
+
+// Instructions of a compiled loop, run on a small stack machine
+typedef enum {
+    OP_CONST,       // push value
+    OP_LOAD,        // push variable a (slot in the variable table)
+    OP_LOCAL,       // push local a (error if that variable was never assigned)
+    OP_STORE,       // variable a = top
+    OP_STORE_LOCAL, // local a = top
+    OP_NEG,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_VECTOR,      // pop a values and push a vector of them
+    OP_BUILTIN,     // apply built-in function a to the top value
+    OP_PRINT,       // pop and print a statement result (of variable names[a])
+    OP_EOL,         // end of a body line
+    OP_ENTER,       // entering loop a: forget the values cached for it
+    OP_CACHED,      // if local a is cached for loop b: push it and go to jump
+    OP_SAVE,        // local a = top, cached for loop b
+    OP_COUNT,       // pop a repeat count into local a
+    OP_NEXT,        // go to jump if local a (repeat counter) is used up, else decrement it
+    OP_JZ,          // pop, go to jump if zero
+    OP_JUMP,        // go to jump
+    OP_ARG,         // pop into local a (argument of an inlined call)
+    OP_CALL,        // call function a with the top b values as arguments
+    OP_FAIL,        // raise the error for a bad call of function names[a] (b: its arity, -1 if undefined)
+} OpCode;
+
+typedef struct {
+    OpCode op;
+    int a;
+    int b;
+    size_t jump;
+    Num value;
+} Instr;
+
+DARRAY_DEFINE(InstrArray, Instr, 16)
+DARRAY_DEFINE(TokenArray, Token, 4)
+
+// A compiled loop. Locals hold variables first assigned inside the loop
+// (named, copied to the variable table when it ends), repeat counters and
+// cached loop-invariant values (unnamed).
+struct Program {
+    InstrArray code;
+    TokenArray locals; // Name of every local (type ID for variables)
+    TokenArray names;  // Variables printed by OP_PRINT and functions named by OP_FAIL
+    int loops;         // Number of loops, for OP_ENTER/OP_CACHED
+    int depth;         // Stack depth while compiling
+    int stack;         // Deepest stack the code needs
+};
+
+// Size of the memo cache of a memo function (entries, power of two)
+#define MEMO_SIZE 4096
+
+// Functions whose body has at most this many nodes are inlined into compiled code
+#define INLINE_MAX 16
+
+// Direct-mapped cache of results keyed on the bits of the arguments.
+// Entry i holds its arguments at keys[i * arity].
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t ptr keys;
+    Num ptr values;
+    bool ptr used;
+    unsigned long hits;
+    unsigned long misses;
+} Memo;
+
+// Whether workers of a parallel wave are running (see PARALLEL). Memo caches
+// are only locked then; it changes while no other thread is.
+bool threads_active = false;
+
+void memo_lock(Memo ptr memo) {
+    if (threads_active) pthread_mutex_lock(ref memo->lock);
+}
+
+void memo_unlock(Memo ptr memo) {
+    if (threads_active) pthread_mutex_unlock(ref memo->lock);
+}
+
+// A function: a single expression of its parameters, compiled once.
+// Parameters are locals 0..arity-1 of its program.
+struct Function {
+    char ptr name;
+    TokenArray params;
+    Ast ptr body;    // Kept for inlining
+    int size;        // Nodes in the body
+    Program program;
+    Memo ptr memo;   // NULL unless defined with memo
+};
+
+// Parameter (or inlined argument) bound to a local
+typedef struct {
+    Token name;
+    int local;
+} Binding;
+
+DARRAY_DEFINE(BindingArray, Binding, 4)
+
+// Variables assigned inside a loop being compiled
+typedef struct {
+    int id;
+    TokenArray assigned;
+} LoopScope;
+
+DARRAY_DEFINE(ScopeArray, LoopScope, 4)
+
+typedef struct {
+    Interpreter ptr interpreter;
+    Program ptr program;
+    ScopeArray scopes;       // Enclosing loops, innermost last
+    BindingArray ptr params; // Names visible in a function body (NULL outside functions)
+} Compiler;
+
+void compile_loop(Compiler ptr compiler, Ast ptr node);
+void compile_call(Compiler ptr compiler, Ast ptr node, bool hoist);
+
+// Append an instruction that changes the stack depth by effect
+size_t emit(Program ptr program, Instr instr, int effect) {
+    InstrArray_add(ref program->code, instr);
+    program->depth += effect;
+    if (program->depth > program->stack) program->stack = program->depth;
+    return program->code.elCount - 1;
+}
+
+// Point a jump at the next instruction
+void patch(Program ptr program, size_t at) {
+    InstrArray_data(ref program->code)[at].jump = program->code.elCount;
+}
+
+// Get the local holding a variable, creating it on first use
+int local_variable(Program ptr program, Token name) {
+    for (size_t i = 0; i < program->locals.elCount; i++) {
+        Token local = TokenArray_at(ref program->locals, i);
+        if (local.type == ID && strcmp(local.value, name.value) == 0) {
+            return (int)i;
+        }
+    }
+    TokenArray_add(ref program->locals, name);
+    return (int)program->locals.elCount - 1;
+}
+
+// Create an unnamed local
+int local_temp(Program ptr program) {
+    TokenArray_add(ref program->locals, (Token){.type = NUMBER});
+    return (int)program->locals.elCount - 1;
+}
+
+// Find a function by name (NULL if undefined)
+Function ptr find_function(Interpreter ptr interpreter, const char ptr name, int ptr index) {
+    for (int i = 0; i < interpreter->ftable.count; i++) {
+        if (strcmp(interpreter->ftable.funcs[i]->name, name) == 0) {
+            if (index) *index = i;
+            return interpreter->ftable.funcs[i];
+        }
+    }
+    return NULL;
+}
+
+// Find the function a call refers to, checking its arguments
+Function ptr resolve_call(Interpreter ptr interpreter, Ast ptr node, int ptr index) {
+    Function ptr fn = find_function(interpreter, node->name.value, index);
+    if (!fn) {
+        error("Undefined function: %s", node->name.value);
+    }
+    if (fn->params.elCount != node->args->childrend.elCount) {
+        error("Function %s takes %zu argument%s", fn->name, fn->params.elCount,
+              fn->params.elCount == 1 ? "" : "s");
+    }
+    return fn;
+}
+
+// Collect the variables assigned anywhere in a loop body
+void collect_assigned(Ast ptr node, TokenArray ptr assigned) {
+    switch (node->type) {
+        case AST_ASSIGN:
+            TokenArray_add(assigned, node->left->token);
+            break;
+        case AST_REPEAT:
+        case AST_WHILE:
+            collect_assigned(node->body, assigned);
+            break;
+        case AST_COMPOUND:
+            for (size_t i = 0; i < node->childrend.elCount; i++) {
+                collect_assigned(AstArray_at(ref node->childrend, i), assigned);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Whether an expression reads a variable assigned in the loop
+bool reads_assigned(Ast ptr node, LoopScope ptr scope) {
+    switch (node->type) {
+        case AST_VAR:
+            for (size_t i = 0; i < scope->assigned.elCount; i++) {
+                if (strcmp(TokenArray_at(ref scope->assigned, i).value, node->token.value) == 0) {
+                    return true;
+                }
+            }
+            return false;
+        case AST_UNARY:
+            return reads_assigned(node->expr, scope);
+        case AST_BINOP:
+            return reads_assigned(node->left, scope) || reads_assigned(node->right, scope);
+        case AST_CALL:
+            // Functions are pure: a call only depends on its arguments
+            for (size_t i = 0; i < node->args->childrend.elCount; i++) {
+                if (reads_assigned(AstArray_at(ref node->args->childrend, i), scope)) return true;
+            }
+            return false;
+        case AST_VECTOR:
+            for (size_t i = 0; i < node->childrend.elCount; i++) {
+                if (reads_assigned(AstArray_at(ref node->childrend, i), scope)) return true;
+            }
+            return false;
+        default:
+            return false;
+    }
+}
+
+// Replace every operator of numbers only by its value, bottom up, in one
+// pass over a loop or function body (a division by zero is left to fail at
+// run time). Returns whether the node is a number now.
+bool fold_constants(Ast ptr node) {
+    switch (node->type) {
+        case AST_NUM:
+            return true;
+        case AST_UNARY: {
+            if (!fold_constants(node->expr)) return false;
+            Num value = node->op.type == MINUS ? -node->expr->value : +node->expr->value;
+            Ast_Free(node->expr);
+            *node = (Ast){.type = AST_NUM, .value = value, .token = {.type = NUMBER}};
+            return true;
+        }
+        case AST_BINOP: {
+            bool left = fold_constants(node->left);
+            bool right = fold_constants(node->right);
+            if (!left || !right) return false;
+            Num a = node->left->value, b = node->right->value, value;
+            switch (node->op.type) {
+                case PLUS: value = a + b; break;
+                case MINUS: value = a - b; break;
+                case MUL: value = a * b; break;
+                case DIV:
+                    if (b == 0) return false;
+                    value = a / b;
+                    break;
+                default: return false;
+            }
+            Ast_Free(node->left);
+            Ast_Free(node->right);
+            *node = (Ast){.type = AST_NUM, .value = value, .token = {.type = NUMBER}};
+            return true;
+        }
+        case AST_ASSIGN:
+            fold_constants(node->right);
+            return false;
+        case AST_REPEAT:
+        case AST_WHILE:
+            fold_constants(node->cond);
+            fold_constants(node->body);
+            return false;
+        case AST_CALL:
+            fold_constants(node->args);
+            return false;
+        case AST_COMPOUND:
+        case AST_VECTOR:
+            for (size_t i = 0; i < node->childrend.elCount; i++) {
+                fold_constants(AstArray_at(ref node->childrend, i));
+            }
+            return false;
+        default:
+            return false;
+    }
+}
+
+// Compile an expression. With hoist set, subexpressions that read no
+// variable assigned in a loop are computed once per entry of that loop:
+// the first evaluation caches the value, so errors still happen where the
+// uncompiled code would raise them. Constants are folded already.
+void compile_expr(Compiler ptr compiler, Ast ptr node, bool hoist) {
+    Program ptr program = compiler->program;
+    if (hoist && (node->type == AST_BINOP || node->type == AST_UNARY ||
+                  node->type == AST_CALL || node->type == AST_VECTOR)) {
+        // Outermost enclosing loop the expression is invariant in
+        int owner = -1;
+        for (size_t i = compiler->scopes.elCount; i-- > 0;) {
+            LoopScope ptr scope = ref ScopeArray_data(ref compiler->scopes)[i];
+            if (reads_assigned(node, scope)) break;
+            owner = scope->id;
+        }
+        if (owner >= 0) {
+            int local = local_temp(program);
+            size_t cached = emit(program, (Instr){.op = OP_CACHED, .a = local, .b = owner}, 0);
+            compile_expr(compiler, node, false);
+            emit(program, (Instr){.op = OP_SAVE, .a = local, .b = owner}, 0);
+            patch(program, cached);
+            return;
+        }
+    }
+
+    switch (node->type) {
+        case AST_NUM:
+            emit(program, (Instr){.op = OP_CONST, .value = node->value}, 1);
+            break;
+        case AST_VAR: {
+            if (compiler->params) {
+                for (size_t i = 0; i < compiler->params->elCount; i++) {
+                    Binding binding = BindingArray_at(compiler->params, i);
+                    if (strcmp(binding.name.value, node->token.value) == 0) {
+                        emit(program, (Instr){.op = OP_LOCAL, .a = binding.local}, 1);
+                        return;
+                    }
+                }
+                error("Undefined variable: %s", node->token.value);
+            }
+            int slot = find_variable(compiler->interpreter, node->token.value);
+            if (slot >= 0) {
+                emit(program, (Instr){.op = OP_LOAD, .a = slot}, 1);
+            } else {
+                emit(program, (Instr){.op = OP_LOCAL, .a = local_variable(program, node->token)}, 1);
+            }
+            break;
+        }
+        case AST_UNARY:
+            compile_expr(compiler, node->expr, hoist);
+            if (node->op.type == MINUS) {
+                emit(program, (Instr){.op = OP_NEG}, 0);
+            }
+            break;
+        case AST_BINOP: {
+            compile_expr(compiler, node->left, hoist);
+            compile_expr(compiler, node->right, hoist);
+            OpCode op;
+            switch (node->op.type) {
+                case PLUS: op = OP_ADD; break;
+                case MINUS: op = OP_SUB; break;
+                case MUL: op = OP_MUL; break;
+                case DIV: op = OP_DIV; break;
+                default: error("Unknown operator"); return;
+            }
+            emit(program, (Instr){.op = op}, -1);
+            break;
+        }
+        case AST_CALL:
+            compile_call(compiler, node, hoist);
+            break;
+        case AST_VECTOR: {
+            AstArray ptr elements = ref node->childrend;
+            for (size_t i = 0; i < elements->elCount; i++) {
+                compile_expr(compiler, AstArray_at(elements, i), hoist);
+            }
+            emit(program, (Instr){.op = OP_VECTOR, .a = (int)elements->elCount}, 1 - (int)elements->elCount);
+            break;
+        }
+        default:
+            error("Invalid syntax");
+            break;
+    }
+}
+
+// Compile a call: small functions are inlined, with their arguments in
+// locals; others are called. A bad call fails when it is reached.
+void compile_call(Compiler ptr compiler, Ast ptr node, bool hoist) {
+    Program ptr program = compiler->program;
+    AstArray ptr args = ref node->args->childrend;
+    int builtin = find_builtin(node->name.value);
+    if (builtin >= 0 && args->elCount == 1) {
+        compile_expr(compiler, AstArray_at(args, 0), hoist);
+        emit(program, (Instr){.op = OP_BUILTIN, .a = builtin}, 0);
+        return;
+    }
+
+    int index = -1;
+    Function ptr fn = builtin < 0 ? find_function(compiler->interpreter, node->name.value, ref index) : NULL;
+
+    if (!fn || fn->params.elCount != args->elCount) {
+        for (size_t i = 0; i < args->elCount; i++) {
+            compile_expr(compiler, AstArray_at(args, i), hoist);
+        }
+        TokenArray_add(ref program->names, node->name);
+        emit(program, (Instr){.op = OP_FAIL, .a = (int)program->names.elCount - 1,
+                              .b = fn ? (int)fn->params.elCount : builtin >= 0 ? 1 : -1}, 1 - (int)args->elCount);
+        return;
+    }
+
+    if (!fn->memo && fn->size <= INLINE_MAX) {
+        BindingArray params = BindingArray_Init();
+        for (size_t i = 0; i < args->elCount; i++) {
+            compile_expr(compiler, AstArray_at(args, i), hoist);
+            int local = local_temp(program);
+            emit(program, (Instr){.op = OP_ARG, .a = local}, -1);
+            BindingArray_add(ref params, (Binding){TokenArray_at(ref fn->params, i), local});
+        }
+        BindingArray ptr outer = compiler->params;
+        compiler->params = ref params;
+        compile_expr(compiler, fn->body, false);
+        compiler->params = outer;
+        BindingArray_destroy(ref params);
+        return;
+    }
+
+    for (size_t i = 0; i < args->elCount; i++) {
+        compile_expr(compiler, AstArray_at(args, i), hoist);
+    }
+    emit(program, (Instr){.op = OP_CALL, .a = index, .b = (int)args->elCount}, 1 - (int)args->elCount);
+}
+
+// Compile a statement of a loop body
+void compile_statement(Compiler ptr compiler, Ast ptr node) {
+    Program ptr program = compiler->program;
+    switch (node->type) {
+        case AST_ASSIGN: {
+            compile_expr(compiler, node->right, true);
+            int slot = find_variable(compiler->interpreter, node->left->token.value);
+            if (slot >= 0) {
+                emit(program, (Instr){.op = OP_STORE, .a = slot}, 0);
+            } else {
+                emit(program, (Instr){.op = OP_STORE_LOCAL, .a = local_variable(program, node->left->token)}, 0);
+            }
+            TokenArray_add(ref program->names, node->left->token);
+            emit(program, (Instr){.op = OP_PRINT, .a = (int)program->names.elCount - 1}, -1);
+            break;
+        }
+        case AST_REPEAT:
+        case AST_WHILE:
+            // Results of the line before the loop are a line of their own
+            emit(program, (Instr){.op = OP_EOL}, 0);
+            compile_loop(compiler, node);
+            break;
+        default:
+            break;
+    }
+}
+
+// Compile a loop: the count of repeat is evaluated once on entry,
+// the condition of while before every iteration
+void compile_loop(Compiler ptr compiler, Ast ptr node) {
+    Program ptr program = compiler->program;
+    int id = program->loops++;
+    int counter = -1;
+    if (node->type == AST_REPEAT) {
+        compile_expr(compiler, node->cond, true);
+        counter = local_temp(program);
+        emit(program, (Instr){.op = OP_COUNT, .a = counter}, -1);
+    }
+    emit(program, (Instr){.op = OP_ENTER, .a = id}, 0);
+
+    LoopScope scope = {.id = id, .assigned = TokenArray_Init()};
+    collect_assigned(node->body, ref scope.assigned);
+    ScopeArray_add(ref compiler->scopes, scope);
+
+    size_t start = program->code.elCount;
+    size_t exit;
+    if (node->type == AST_REPEAT) {
+        exit = emit(program, (Instr){.op = OP_NEXT, .a = counter}, 0);
+    } else {
+        compile_expr(compiler, node->cond, true);
+        exit = emit(program, (Instr){.op = OP_JZ}, -1);
+    }
+
+    AstArray ptr lines = ref node->body->childrend;
+    for (size_t l = 0; l < lines->elCount; l++) {
+        Ast ptr line = AstArray_at(lines, l);
+        for (size_t i = 0; i < line->childrend.elCount; i++) {
+            compile_statement(compiler, AstArray_at(ref line->childrend, i));
+        }
+        emit(program, (Instr){.op = OP_EOL}, 0);
+    }
+    emit(program, (Instr){.op = OP_JUMP, .jump = start}, 0);
+    patch(program, exit);
+
+    compiler->scopes.elCount--;
+    TokenArray_destroy(ref scope.assigned);
+}
+
+Value call_function(Interpreter ptr interpreter, Function ptr fn, const Value ptr args);
+
+// Largest repeat count: past it, counting down by one leaves a double unchanged
+#define REPEAT_MAX 9007199254740992.0
+
+// Frames up to this size live on the C stack
+#define FRAME_INLINE 32
+
+// Run a compiled loop or function, with (references to) args in its first
+// locals. Returns the value left on the stack (the result of a function).
+// Stack slots and locals hold a reference each.
+Value run_program(Interpreter ptr interpreter, Program ptr program, const Value ptr args, int argc) {
+    size_t locals_count = program->locals.elCount;
+    Value stack_small[FRAME_INLINE], locals_small[FRAME_INLINE];
+    unsigned long stamps_small[FRAME_INLINE], epochs_small[FRAME_INLINE];
+    Value ptr stack = stack_small;
+    Value ptr locals = locals_small;
+    unsigned long ptr stamps = stamps_small; // 0 = unset
+    unsigned long ptr epochs = epochs_small;
+
+    bool small = program->stack < FRAME_INLINE && locals_count < FRAME_INLINE && program->loops < FRAME_INLINE;
+    if (small) {
+        memset(locals, 0, locals_count * sizeof(Value));
+        memset(stamps, 0, locals_count * sizeof(unsigned long));
+        memset(epochs, 0, program->loops * sizeof(unsigned long));
+    } else {
+        stack = frame_alloc((program->stack + locals_count + 2) * sizeof(Value) +
+                            (locals_count + program->loops + 2) * sizeof(unsigned long));
+        locals = stack + program->stack + 1;
+        stamps = (unsigned long ptr)(locals + locals_count + 1);
+        epochs = stamps + locals_count + 1;
+    }
+    for (int i = 0; i < argc; i++) {
+        locals[i] = value_retain(args[i]);
+        stamps[i] = 1;
+    }
+
+    // The table doesn't grow while the loop runs, so slots stay valid
+    Variable ptr vars = interpreter->vtable.vars;
+    Instr ptr code = InstrArray_data(ref program->code);
+    size_t count = program->code.elCount;
+    int sp = 0;
+
+    for (size_t pc = 0; pc < count; pc++) {
+        Instr ptr in = ref code[pc];
+        switch (in->op) {
+            case OP_CONST:
+                stack[sp++] = value_num(in->value);
+                break;
+            case OP_LOAD:
+                stack[sp++] = value_retain(vars[in->a].value);
+                break;
+            case OP_LOCAL:
+                if (!stamps[in->a]) {
+                    error("Undefined variable: %s", TokenArray_at(ref program->locals, in->a).value);
+                }
+                stack[sp++] = value_retain(locals[in->a]);
+                break;
+            case OP_STORE:
+                value_release(vars[in->a].value);
+                vars[in->a].value = value_retain(stack[sp - 1]);
+                break;
+            case OP_STORE_LOCAL:
+                value_release(locals[in->a]);
+                locals[in->a] = value_retain(stack[sp - 1]);
+                stamps[in->a] = 1;
+                break;
+            case OP_NEG:
+                if (is_vector(stack[sp - 1])) {
+                    stack[sp - 1] = vector_negate(stack[sp - 1]);
+                } else {
+                    stack[sp - 1].num = -stack[sp - 1].num;
+                }
+                break;
+            case OP_ADD:
+                sp--;
+                if (is_vector(stack[sp - 1]) || is_vector(stack[sp])) {
+                    stack[sp - 1] = vector_binop(PLUS, stack[sp - 1], stack[sp]);
+                } else {
+                    stack[sp - 1].num = stack[sp - 1].num + stack[sp].num;
+                }
+                break;
+            case OP_SUB:
+                sp--;
+                if (is_vector(stack[sp - 1]) || is_vector(stack[sp])) {
+                    stack[sp - 1] = vector_binop(MINUS, stack[sp - 1], stack[sp]);
+                } else {
+                    stack[sp - 1].num = stack[sp - 1].num - stack[sp].num;
+                }
+                break;
+            case OP_MUL:
+                sp--;
+                if (is_vector(stack[sp - 1]) || is_vector(stack[sp])) {
+                    stack[sp - 1] = vector_binop(MUL, stack[sp - 1], stack[sp]);
+                } else {
+                    stack[sp - 1].num = stack[sp - 1].num * stack[sp].num;
+                }
+                break;
+            case OP_DIV:
+                sp--;
+                if (is_vector(stack[sp - 1]) || is_vector(stack[sp])) {
+                    stack[sp - 1] = vector_binop(DIV, stack[sp - 1], stack[sp]);
+                } else {
+                    if (stack[sp].num == 0) {
+                        error("Division by zero");
+                    }
+                    stack[sp - 1].num = stack[sp - 1].num / stack[sp].num;
+                }
+                break;
+            case OP_VECTOR:
+                sp -= in->a;
+                stack[sp] = vector_literal(stack + sp, in->a);
+                sp++;
+                break;
+            case OP_BUILTIN: {
+                Num result = call_builtin(in->a, stack[sp - 1]);
+                value_release(stack[sp - 1]);
+                stack[sp - 1] = value_num(result);
+                break;
+            }
+            case OP_PRINT:
+                sp--;
+                print_result(interpreter, TokenArray_at(ref program->names, in->a).value, stack[sp]);
+                value_release(stack[sp]);
+                break;
+            case OP_EOL:
+                end_output_line(interpreter);
+                break;
+            case OP_ENTER:
+                epochs[in->a]++;
+                break;
+            case OP_CACHED:
+                if (stamps[in->a] == epochs[in->b]) {
+                    stack[sp++] = value_retain(locals[in->a]);
+                    pc = in->jump - 1;
+                }
+                break;
+            case OP_SAVE:
+                value_release(locals[in->a]);
+                locals[in->a] = value_retain(stack[sp - 1]);
+                stamps[in->a] = epochs[in->b];
+                break;
+            case OP_COUNT: {
+                Value count = stack[--sp];
+                if (is_vector(count) || isnan(count.num)) {
+                    error("Repeat count must be a number");
+                }
+                Num n = count.num;
+                if (n > REPEAT_MAX) {
+                    error("Repeat count must be at most 2^53");
+                }
+                locals[in->a] = value_num(n > 0 ? floor(n) : 0);
+                break;
+            }
+            case OP_NEXT:
+                if (locals[in->a].num <= 0) {
+                    pc = in->jump - 1;
+                } else {
+                    locals[in->a].num -= 1;
+                }
+                break;
+            case OP_JZ:
+                sp--;
+                if (is_vector(stack[sp])) {
+                    error("Loop condition must be a number");
+                }
+                if (stack[sp].num == 0) {
+                    pc = in->jump - 1;
+                }
+                break;
+            case OP_JUMP:
+                pc = in->jump - 1;
+                break;
+            case OP_ARG:
+                value_release(locals[in->a]);
+                locals[in->a] = stack[--sp];
+                stamps[in->a] = 1;
+                break;
+            case OP_CALL: {
+                sp -= in->b;
+                Value result = call_function(interpreter, interpreter->ftable.funcs[in->a], stack + sp);
+                for (int i = 0; i < in->b; i++) {
+                    value_release(stack[sp + i]);
+                }
+                stack[sp++] = result;
+                break;
+            }
+            case OP_FAIL: {
+                const char ptr name = TokenArray_at(ref program->names, in->a).value;
+                if (in->b < 0) {
+                    error("Undefined function: %s", name);
+                }
+                error("Function %s takes %d argument%s", name, in->b, in->b == 1 ? "" : "s");
+                break;
+            }
+        }
+    }
+    Value result = sp > 0 ? stack[sp - 1] : value_num(0);
+
+    // Publish the variables the loop created
+    for (size_t i = 0; i < locals_count; i++) {
+        Token local = TokenArray_at(ref program->locals, i);
+        if (local.type == ID && stamps[i]) {
+            set_variable(interpreter, local.value, locals[i]);
+        } else {
+            value_release(locals[i]);
+        }
+    }
+
+    if (!small) frame_free(stack);
+    return result;
+}
+
+// Visit loop node: the body is compiled once, with variables resolved to
+// slots, and then run as many times as needed without touching the Ast
+void visit_Loop(Interpreter ptr interpreter, Ast ptr node) {
+    Program ptr program = malloc(sizeof(Program));
+    if (!program) {
+        error("Memory allocation failed");
+    }
+    *program = (Program){.code = InstrArray_Init(), .locals = TokenArray_Init(), .names = TokenArray_Init()};
+    interpreter->loop = program;
+    Compiler compiler = {.interpreter = interpreter, .program = program, .scopes = ScopeArray_Init()};
+    fold_constants(node);
+    compile_loop(ref compiler, node);
+    ScopeArray_destroy(ref compiler.scopes);
+    Ast_Destroy(node);
+
+    end_output_line(interpreter); // Results of the line before the loop are a line of their own
+    value_release(run_program(interpreter, program, NULL, 0));
+    interpreter->loop = NULL;
+    Program_Destroy(program);
+    free(program);
+}
+
+// Mix the bits of the arguments into a cache index
+size_t memo_hash(const uint64_t ptr args, size_t arity) {
+    uint64_t hash = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < arity; i++) {
+        uint64_t bits = args[i];
+        // Fold the high bits down too: small integers only differ up there
+        hash ^= bits;
+        hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+        hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBull;
+        hash ^= hash >> 31;
+    }
+    return (size_t)(hash & (MEMO_SIZE - 1));
+}
+
+// Largest arity of the calls that go through a memo cache
+#define MEMO_ARITY 16
+
+// Call a function (the arguments are left to the caller), going through its
+// memo cache if it has one
+Value call_function(Interpreter ptr interpreter, Function ptr fn, const Value ptr args) {
+    Memo ptr memo = fn->memo;
+    size_t arity = fn->params.elCount;
+    // Only numbers are cached
+    uint64_t bits[MEMO_ARITY];
+    if (arity > MEMO_ARITY) memo = NULL;
+    for (size_t i = 0; memo && i < arity; i++) {
+        if (is_vector(args[i])) memo = NULL;
+        else memcpy(ref bits[i], ref args[i].num, sizeof(uint64_t));
+    }
+    if (!memo) {
+        return run_program(interpreter, ref fn->program, args, (int)arity);
+    }
+
+    size_t index = memo_hash(bits, arity);
+    uint64_t ptr key = memo->keys + index * arity;
+    memo_lock(memo);
+    if (memo->used[index] && memcmp(key, bits, arity * sizeof(uint64_t)) == 0) {
+        memo->hits++;
+        Num result = memo->values[index];
+        memo_unlock(memo);
+        return value_num(result);
+    }
+    memo->misses++;
+    memo_unlock(memo);
+
+    Value result = run_program(interpreter, ref fn->program, args, (int)arity);
+    if (is_vector(result)) return result;
+
+    memo_lock(memo);
+    memcpy(key, bits, arity * sizeof(uint64_t));
+    memo->values[index] = result.num;
+    memo->used[index] = true;
+    memo_unlock(memo);
+    return result;
+}
+
+// Count the nodes of an expression
+int count_nodes(Ast ptr node) {
+    switch (node->type) {
+        case AST_UNARY:
+            return 1 + count_nodes(node->expr);
+        case AST_BINOP:
+            return 1 + count_nodes(node->left) + count_nodes(node->right);
+        case AST_CALL: {
+            int count = 1;
+            for (size_t i = 0; i < node->args->childrend.elCount; i++) {
+                count += count_nodes(AstArray_at(ref node->args->childrend, i));
+            }
+            return count;
+        }
+        case AST_VECTOR: {
+            int count = 1;
+            for (size_t i = 0; i < node->childrend.elCount; i++) {
+                count += count_nodes(AstArray_at(ref node->childrend, i));
+            }
+            return count;
+        }
+        default:
+            return 1;
+    }
+}
+
+// Check that a function body only uses its parameters and well-formed calls
+void check_function_body(Interpreter ptr interpreter, Function ptr fn, Ast ptr node) {
+    switch (node->type) {
+        case AST_VAR:
+            for (size_t i = 0; i < fn->params.elCount; i++) {
+                if (strcmp(TokenArray_at(ref fn->params, i).value, node->token.value) == 0) return;
+            }
+            error("Undefined variable: %s", node->token.value);
+            break;
+        case AST_UNARY:
+            check_function_body(interpreter, fn, node->expr);
+            break;
+        case AST_BINOP:
+            check_function_body(interpreter, fn, node->left);
+            check_function_body(interpreter, fn, node->right);
+            break;
+        case AST_CALL:
+            if (find_builtin(node->name.value) >= 0) {
+                check_builtin_call(node);
+            } else {
+                resolve_call(interpreter, node, NULL);
+            }
+            for (size_t i = 0; i < node->args->childrend.elCount; i++) {
+                check_function_body(interpreter, fn, AstArray_at(ref node->args->childrend, i));
+            }
+            break;
+        case AST_VECTOR:
+            for (size_t i = 0; i < node->childrend.elCount; i++) {
+                check_function_body(interpreter, fn, AstArray_at(ref node->childrend, i));
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Visit function definition node: compile the body once and add it to the function table
+void visit_Def(Interpreter ptr interpreter, Ast ptr node) {
+    if (find_function(interpreter, node->name.value, NULL)) {
+        error("Function %s is already defined", node->name.value);
+    }
+    if (find_builtin(node->name.value) >= 0) {
+        error("Function %s is built in", node->name.value);
+    }
+
+    Function ptr fn = calloc(1, sizeof(Function));
+    if (!fn) {
+        error("Memory allocation failed");
+    }
+    interpreter->defining = fn;
+    fn->name = strdup(node->name.value);
+    fn->params = TokenArray_Init();
+    for (size_t i = 0; i < node->args->childrend.elCount; i++) {
+        Token param = AstArray_at(ref node->args->childrend, i)->token;
+        for (size_t j = 0; j < i; j++) {
+            if (strcmp(TokenArray_at(ref fn->params, j).value, param.value) == 0) {
+                error("Duplicate parameter %s in function %s", param.value, fn->name);
+            }
+        }
+        TokenArray_add(ref fn->params, param);
+    }
+    fn->body = node->fbody;
+    fold_constants(fn->body);
+    fn->size = count_nodes(fn->body);
+    check_function_body(interpreter, fn, fn->body);
+
+    // Parameters are the first locals
+    fn->program = (Program){.code = InstrArray_Init(), .locals = TokenArray_Init(), .names = TokenArray_Init()};
+    BindingArray params = BindingArray_Init();
+    for (size_t i = 0; i < fn->params.elCount; i++) {
+        BindingArray_add(ref params, (Binding){TokenArray_at(ref fn->params, i), local_temp(ref fn->program)});
+    }
+    Compiler compiler = {.interpreter = interpreter, .program = ref fn->program,
+                         .scopes = ScopeArray_Init(), .params = ref params};
+    compile_expr(ref compiler, fn->body, false);
+    BindingArray_destroy(ref params);
+
+    if (node->memo) {
+        size_t arity = fn->params.elCount;
+        fn->memo = calloc(1, sizeof(Memo));
+        if (!fn->memo) {
+            error("Memory allocation failed");
+        }
+        pthread_mutex_init(ref fn->memo->lock, NULL);
+        fn->memo->keys = calloc(MEMO_SIZE * (arity ? arity : 1), sizeof(uint64_t));
+        fn->memo->values = calloc(MEMO_SIZE, sizeof(Num));
+        fn->memo->used = calloc(MEMO_SIZE, sizeof(bool));
+        if (!fn->memo->keys || !fn->memo->values || !fn->memo->used) {
+            error("Memory allocation failed");
+        }
+    }
+
+    FunctionTable ptr table = ref interpreter->ftable;
+    if (table->count == table->capacity) {
+        table->capacity = table->capacity ? table->capacity * 2 : 4;
+        table->funcs = realloc(table->funcs, table->capacity * sizeof(Function ptr));
+        if (!table->funcs) {
+            error("Memory allocation failed");
+        }
+    }
+    table->funcs[table->count++] = fn;
+    interpreter->defining = NULL;
+
+    node->fbody = NULL; // Owned by the function now
+    Ast_Destroy(node);
+}
+
+// Free a function and its compiled code
+void Function_Destroy(Function ptr fn) {
+    free(fn->name);
+    TokenArray_destroy(ref fn->params);
+    if (fn->body) Ast_Destroy(fn->body); // NULL if its definition failed early
+    Program_Destroy(ref fn->program);
+    if (fn->memo) {
+        pthread_mutex_destroy(ref fn->memo->lock);
+        free(fn->memo->keys);
+        free(fn->memo->values);
+        free(fn->memo->used);
+        free(fn->memo);
+    }
+    free(fn);
+}
+
+// Free the code of a program
+void Program_Destroy(Program ptr program) {
+    InstrArray_destroy(ref program->code);
+    TokenArray_destroy(ref program->locals);
+    TokenArray_destroy(ref program->names);
+}
+
+// Visit function call node
+Value visit_Call(Interpreter ptr interpreter, Ast ptr node) {
+    AstArray ptr args = ref node->args->childrend;
+    size_t argc = args->elCount;
+    Value small[8];
+    Value ptr values = argc <= 8 ? small : frame_alloc(argc * sizeof(Value));
+    for (size_t i = 0; i < argc; i++) {
+        values[i] = visit(interpreter, AstArray_at(args, i));
+    }
+
+    Value result;
+    int builtin = find_builtin(node->name.value);
+    if (builtin >= 0) {
+        check_builtin_call(node);
+        args->elCount = 0; // Visited (and freed) already
+        result = value_num(call_builtin(builtin, values[0]));
+    } else {
+        Function ptr fn = resolve_call(interpreter, node, NULL);
+        args->elCount = 0;
+        result = call_function(interpreter, fn, values);
+    }
+    for (size_t i = 0; i < argc; i++) {
+        value_release(values[i]);
+    }
+    if (values != small) frame_free(values);
+    Ast_Destroy(node);
+    return result;
+}
+
+// Print hit/miss counters of the memo functions
+void print_memo_stats(Interpreter ptr interpreter) {
+    for (int i = 0; i < interpreter->ftable.count; i++) {
+        Function ptr fn = interpreter->ftable.funcs[i];
+        if (fn->memo) {
+            fprintf(stderr, "memo %s: %lu hits, %lu misses\n", fn->name, fn->memo->hits, fn->memo->misses);
+        }
+    }
+}
+
+/*
+###############################################################################
+#                                                                             #
+#  PARALLEL                                                                   #
+#                                                                             #
+###############################################################################
+*/
+
+// Maximum number of statements scheduled together
+#define BATCH_MAX (1024 * 4)
+
+// Maximum amount of source text per batch, so its ASTs stay in cache
+#define BATCH_BYTES (1024 * 16)
+
+// Waves smaller than this run on the calling thread
+#define WAVE_MIN_PARALLEL 64
+
+// Task run by the thread pool for every item of a wave
+typedef void (ptr TaskFn)(void ptr ctx, size_t item);
+
+// Range of wave items owned by one worker: [head, tail), head in the low
+// half, so the owner and thieves each claim an item with one compare-and-swap.
+// A queue has a cache line to itself, so owners don't slow each other down.
+typedef struct {
+    _Alignas(64) _Atomic uint64_t range;
+} TaskQueue;
+
+#define TASK_RANGE(head, tail) ((uint64_t)(tail) << 32 | (uint32_t)(head))
+
+typedef struct ThreadPool ThreadPool;
+
+// Thread pool where idle workers steal from the back of busy workers' queues
+struct ThreadPool {
+    int count; // Number of workers (the calling thread is worker 0)
+    pthread_t ptr threads;
+    TaskQueue ptr queues;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    unsigned long generation;
+    int running;
+    bool shutdown;
+    const size_t ptr items;
+    TaskFn task;
+    void ptr ctx;
+};
+
+typedef struct {
+    ThreadPool ptr pool;
+    int id;
+} Worker;
+
+// Take the next item from the worker's own queue
+bool pool_pop(ThreadPool ptr pool, int id, size_t ptr item) {
+    TaskQueue ptr queue = ref pool->queues[id];
+    uint64_t range = atomic_load_explicit(ref queue->range, memory_order_relaxed);
+    for (;;) {
+        uint32_t head = (uint32_t)range, tail = (uint32_t)(range >> 32);
+        if (head >= tail) return false;
+        if (atomic_compare_exchange_weak_explicit(ref queue->range, ref range, TASK_RANGE(head + 1, tail),
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            *item = head;
+            return true;
+        }
+    }
+}
+
+// Take an item from the back of another worker's queue
+bool pool_steal(ThreadPool ptr pool, int id, size_t ptr item) {
+    for (int i = 1; i < pool->count; i++) {
+        TaskQueue ptr victim = ref pool->queues[(id + i) % pool->count];
+        uint64_t range = atomic_load_explicit(ref victim->range, memory_order_relaxed);
+        for (;;) {
+            uint32_t head = (uint32_t)range, tail = (uint32_t)(range >> 32);
+            if (head >= tail) break;
+            if (atomic_compare_exchange_weak_explicit(ref victim->range, ref range, TASK_RANGE(head, tail - 1),
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *item = tail - 1;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Run items until every queue is empty
+void pool_drain(ThreadPool ptr pool, int id) {
+    size_t item;
+    while (pool_pop(pool, id, ref item) || pool_steal(pool, id, ref item)) {
+        pool->task(pool->ctx, pool->items[item]);
+    }
+}
+
+// Worker thread body
+void ptr pool_worker(void ptr arg) {
+    Worker ptr worker = arg;
+    ThreadPool ptr pool = worker->pool;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(ref pool->lock);
+    for (;;) {
+        while (!pool->shutdown && pool->generation == seen) {
+            pthread_cond_wait(ref pool->wake, ref pool->lock);
+        }
+        if (pool->shutdown) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(ref pool->lock);
+
+        pool_drain(pool, worker->id);
+
+        pthread_mutex_lock(ref pool->lock);
+        if (--pool->running == 0) {
+            pthread_cond_signal(ref pool->idle);
+        }
+    }
+    pthread_mutex_unlock(ref pool->lock);
+    free(worker);
+    return NULL;
+}
+
+// Largest worker count -j takes
+#define WORKERS_MAX 64
+
+// Number of workers for -j jobs (0 picks one per CPU). A count given
+// explicitly is used as it is, even past the CPUs, where workers only take
+// turns, so the pool can be tested on any machine.
+int worker_count(int jobs) {
+    int cpus = 0;
+    #ifdef _SC_NPROCESSORS_ONLN
+        cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    #endif
+    if (cpus <= 0) cpus = 4;
+    if (jobs <= 0) return cpus < WORKERS_MAX ? cpus : WORKERS_MAX;
+    return jobs < WORKERS_MAX ? jobs : WORKERS_MAX;
+}
+
+// Create a thread pool with count workers
+ThreadPool ptr ThreadPool_Init(int count) {
+
+    ThreadPool ptr pool = calloc(1, sizeof(ThreadPool));
+    if (!pool) {
+        error("Memory allocation failed");
+    }
+    pool->count = count;
+    pool->threads = calloc(count, sizeof(pthread_t));
+    pool->queues = aligned_alloc(_Alignof(TaskQueue), count * sizeof(TaskQueue));
+    if (!pool->threads || !pool->queues) {
+        error("Memory allocation failed");
+    }
+    pthread_mutex_init(ref pool->lock, NULL);
+    pthread_cond_init(ref pool->wake, NULL);
+    pthread_cond_init(ref pool->idle, NULL);
+    for (int i = 0; i < count; i++) {
+        atomic_init(ref pool->queues[i].range, 0);
+    }
+
+    for (int i = 1; i < count; i++) {
+        Worker ptr worker = malloc(sizeof(Worker));
+        *worker = (Worker){.pool = pool, .id = i};
+        if (pthread_create(ref pool->threads[i], NULL, pool_worker, worker) != 0) {
+            error("Failed to start worker thread");
+        }
+    }
+    return pool;
+}
+
+// Run task for every item and wait until all of them are done
+void ThreadPool_Run(ThreadPool ptr pool, const size_t ptr items, size_t count, TaskFn task, void ptr ctx) {
+    if (pool->count == 1 || count < WAVE_MIN_PARALLEL) {
+        for (size_t i = 0; i < count; i++) {
+            task(ctx, items[i]);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(ref pool->lock);
+    pool->items = items;
+    pool->task = task;
+    pool->ctx = ctx;
+    for (int i = 0; i < pool->count; i++) {
+        atomic_store_explicit(ref pool->queues[i].range,
+                              TASK_RANGE(count * i / pool->count, count * (i + 1) / pool->count),
+                              memory_order_relaxed);
+    }
+    pool->running = pool->count - 1;
+    pool->generation++;
+    threads_active = true;
+    pthread_cond_broadcast(ref pool->wake);
+    pthread_mutex_unlock(ref pool->lock);
+
+    pool_drain(pool, 0);
+
+    pthread_mutex_lock(ref pool->lock);
+    while (pool->running > 0) {
+        pthread_cond_wait(ref pool->idle, ref pool->lock);
+    }
+    threads_active = false;
+    pthread_mutex_unlock(ref pool->lock);
+}
+
+// Stop the workers and release the pool
+void ThreadPool_Destroy(ThreadPool ptr pool) {
+    pthread_mutex_lock(ref pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(ref pool->wake);
+    pthread_mutex_unlock(ref pool->lock);
+
+    for (int i = 1; i < pool->count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(ref pool->lock);
+    pthread_cond_destroy(ref pool->wake);
+    pthread_cond_destroy(ref pool->idle);
+    free(pool->threads);
+    free(pool->queues);
+    free(pool);
+}
+
+// Statements of several lines evaluated together
+typedef struct {
+    Interpreter ptr interpreter;
+    AstArray statements;   // In source order
+    SizeArray line_ends;   // Index one past the last statement of each line
+    Value ptr results;
+    int ptr prints;        // Slot of the variable the statement prints (-1: none)
+    size_t ptr levels;
+    size_t ptr order;      // Statement indices sorted by level
+    pthread_mutex_t lock;
+    size_t failed;         // First statement (in source order) that raised an error
+    char message[256];
+    bool long_line;        // The next line is too long to batch and must be streamed
+    Ast ptr pending;       // Line holding a loop or definition, evaluated after the batch
+} Batch;
+
+// Collect the variables read by an expression
+void collect_reads(Ast ptr node, AstArray ptr reads) {
+    switch (node->type) {
+        case AST_VAR:
+            AstArray_add(reads, node);
+            break;
+        case AST_UNARY:
+            collect_reads(node->expr, reads);
+            break;
+        case AST_BINOP:
+            collect_reads(node->left, reads);
+            collect_reads(node->right, reads);
+            break;
+        case AST_CALL:
+            for (size_t i = 0; i < node->args->childrend.elCount; i++) {
+                collect_reads(AstArray_at(ref node->args->childrend, i), reads);
+            }
+            break;
+        case AST_VECTOR:
+            for (size_t i = 0; i < node->childrend.elCount; i++) {
+                collect_reads(AstArray_at(ref node->childrend, i), reads);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Compute the wave of every statement from its read/write sets.
+// Returns the number of statements that can run: it stops at the first
+// statement reading an undefined variable, which run_batch evaluates after
+// the others so that it fails the way it does sequentially.
+size_t schedule_batch(Batch ptr batch) {
+    Interpreter ptr interpreter = batch->interpreter;
+    size_t count = batch->statements.elCount;
+    AstArray reads = AstArray_Init();
+    IntArray slots_read = IntArray_Init();
+
+    // Per variable: wave of the last write + 1, and of the last read since then + 1
+    size_t slots = interpreter->vtable.count + count;
+    size_t ptr written = calloc(slots, sizeof(size_t));
+    size_t ptr read = calloc(slots, sizeof(size_t));
+    if (!written || !read) {
+        error("Memory allocation failed");
+    }
+
+    size_t runnable = count;
+    for (size_t i = 0; i < count; i++) {
+        Ast ptr statement = AstArray_at(ref batch->statements, i);
+        batch->levels[i] = 0;
+        batch->prints[i] = -1;
+        if (statement->type != AST_ASSIGN) continue;
+
+        size_t level = 0;
+        reads.elCount = 0;
+        slots_read.elCount = 0;
+        collect_reads(statement->right, ref reads);
+        for (size_t r = 0; r < reads.elCount; r++) {
+            Ast ptr var = AstArray_at(ref reads, r);
+            int slot = find_variable(interpreter, var->token.value);
+            if (slot < 0) {
+                runnable = i;
+                goto done;
+            }
+            var->slot = slot;
+            IntArray_add(ref slots_read, slot);
+            if (written[slot] > level) level = written[slot];
+        }
+
+        // Make sure the slot exists before any worker runs, reserved until
+        // the statement assigns it, so it is never read as a made-up value
+        int slot = find_variable(interpreter, statement->left->token.value);
+        if (slot < 0) {
+            set_variable(interpreter, statement->left->token.value, value_num(0));
+            slot = interpreter->vtable.count - 1;
+            interpreter->vtable.vars[slot].reserved = true;
+        }
+        statement->left->slot = slot;
+        batch->prints[i] = slot;
+        if (written[slot] > level) level = written[slot];
+        if (read[slot] > level) level = read[slot];
+
+        for (size_t r = 0; r < slots_read.elCount; r++) {
+            int from = IntArray_at(ref slots_read, r);
+            if (read[from] < level + 1) read[from] = level + 1;
+        }
+        written[slot] = level + 1;
+        batch->levels[i] = level;
+    }
+
+done:
+    AstArray_destroy(ref reads);
+    IntArray_destroy(ref slots_read);
+    free(written);
+    free(read);
+    return runnable;
+}
+
+// Evaluate one statement of the batch, catching its errors
+void run_statement(void ptr ctx, size_t index) {
+    Batch ptr batch = ctx;
+    Ast ptr statement = AstArray_at(ref batch->statements, index);
+    if (statement->type == AST_NoOp) {
+        visit_NoOp(batch->interpreter, statement);
+        return;
+    }
+
+    ErrorTrap trap;
+    if (setjmp(trap.env) == 0) {
+        error_trap = ref trap;
+        batch->results[index] = visit(batch->interpreter, statement);
+        error_trap = NULL;
+        return;
+    }
+    frames_free_all();
+
+    pthread_mutex_lock(ref batch->lock);
+    if (index < batch->failed) {
+        batch->failed = index;
+        strcpy(batch->message, trap.message);
+    }
+    pthread_mutex_unlock(ref batch->lock);
+}
+
+// Evaluate the batch wave by wave and print results in source order
+void run_batch(Batch ptr batch, ThreadPool ptr pool) {
+    size_t count = schedule_batch(batch);
+
+    // Bucket statements by wave
+    size_t waves = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (batch->levels[i] + 1 > waves) waves = batch->levels[i] + 1;
+    }
+    size_t ptr starts = calloc(waves + 1, sizeof(size_t));
+    for (size_t i = 0; i < count; i++) {
+        starts[batch->levels[i] + 1]++;
+    }
+    for (size_t w = 0; w < waves; w++) {
+        starts[w + 1] += starts[w];
+    }
+    size_t ptr fill = malloc((waves + 1) * sizeof(size_t));
+    memcpy(fill, starts, (waves + 1) * sizeof(size_t));
+    for (size_t i = 0; i < count; i++) {
+        batch->order[fill[batch->levels[i]]++] = i;
+    }
+
+    for (size_t w = 0; w < waves; w++) {
+        ThreadPool_Run(pool, batch->order + starts[w], starts[w + 1] - starts[w], run_statement, batch);
+    }
+    free(starts);
+    free(fill);
+
+    // A statement reading an undefined variable raises an error, but an
+    // operand before that variable may raise another one first
+    if (count < batch->statements.elCount && batch->failed > count) {
+        run_statement(batch, count);
+    }
+
+    // Print like visit_Compound, up to the first error
+    size_t first = 0;
+    for (size_t l = 0; l < batch->line_ends.elCount; l++) {
+        size_t end = SizeArray_at(ref batch->line_ends, l);
+        bool nl = false;
+        for (size_t i = first; i < end; i++) {
+            if (i == batch->failed) {
+                error("%s", batch->message);
+            }
+            if (batch->prints[i] >= 0) {
+                output_result(batch->interpreter->vtable.vars[batch->prints[i]].name, batch->results[i]);
+                nl = true;
+            }
+            value_release(batch->results[i]);
+        }
+        if (nl) output_end_line();
+        first = end;
+    }
+    if (batch->failed != SIZE_MAX) {
+        error("%s", batch->message);
+    }
+}
+
+// Whether a line must run on its own: loops print more than one result
+// per statement, and definitions change the function table
+bool is_sequential(Ast ptr tree) {
+    for (size_t i = 0; i < tree->childrend.elCount; i++) {
+        AstType type = AstArray_at(ref tree->childrend, i)->type;
+        if (type == AST_REPEAT || type == AST_WHILE || type == AST_DEF) return true;
+    }
+    return false;
+}
+
+// Evaluate the program in batches of lines, running independent statements in parallel
+void interpret_parallel(Interpreter ptr interpreter, int jobs) {
+    int workers = worker_count(jobs);
+    if (workers == 1) {
+        interpret(interpreter); // Batches would only add their bookkeeping
+        return;
+    }
+    ThreadPool ptr pool = ThreadPool_Init(workers);
+    Batch ptr batch = calloc(1, sizeof(Batch));
+    batch->interpreter = interpreter;
+    batch->statements = AstArray_Init();
+    batch->line_ends = SizeArray_Init();
+    pthread_mutex_init(ref batch->lock, NULL);
+
+    while (interpreter->parser->current_token.type != EOF_TOKEN) {
+        batch->statements.elCount = 0;
+        batch->line_ends.elCount = 0;
+        batch->failed = SIZE_MAX;
+        batch->long_line = false;
+
+        // Parse lines until the batch is full; syntax errors are reported
+        // after the lines before them have been evaluated. Nodes are logged
+        // until their line is parsed, so those of a failed line are freed.
+        ErrorTrap trap;
+        AstLog_Start();
+        if (setjmp(trap.env) == 0) {
+            error_trap = ref trap;
+            size_t bytes = 0;
+            while (interpreter->parser->current_token.type != EOF_TOKEN &&
+                   batch->statements.elCount < BATCH_MAX && bytes < BATCH_BYTES) {
+                bytes += interpreter->parser->lexer->line_len;
+                Ast ptr tree = parse(interpreter->parser);
+                if (!tree) {
+                    batch->long_line = true;
+                    break;
+                }
+                AstLog_Forget(); // The batch owns the line now
+                if (is_sequential(tree)) {
+                    batch->pending = tree;
+                    break;
+                }
+                for (size_t i = 0; i < tree->childrend.elCount; i++) {
+                    AstArray_add(ref batch->statements, AstArray_at(ref tree->childrend, i));
+                }
+                SizeArray_add(ref batch->line_ends, batch->statements.elCount);
+                AstArray_destroy(ref tree->childrend);
+                Ast_Free(tree);
+            }
+            error_trap = NULL;
+        } else {
+            batch->failed = batch->statements.elCount;
+            strcpy(batch->message, trap.message);
+        }
+        AstLog_Stop();
+
+        size_t count = batch->statements.elCount;
+        batch->results = realloc(batch->results, (count + 1) * sizeof(Value));
+        memset(batch->results, 0, (count + 1) * sizeof(Value));
+        batch->prints = realloc(batch->prints, (count + 1) * sizeof(int));
+        batch->levels = realloc(batch->levels, (count + 1) * sizeof(size_t));
+        batch->order = realloc(batch->order, (count + 1) * sizeof(size_t));
+        run_batch(batch, pool);
+        if (batch->long_line) {
+            interpret_stream(interpreter);
+        }
+        if (batch->pending) {
+            value_release(visit(interpreter, batch->pending));
+            batch->pending = NULL;
+        }
+    }
+
+    AstArray_destroy(ref batch->statements);
+    SizeArray_destroy(ref batch->line_ends);
+    pthread_mutex_destroy(ref batch->lock);
+    free(batch->results);
+    free(batch->prints);
+    free(batch->levels);
+    free(batch->order);
+    free(batch);
+    ThreadPool_Destroy(pool);
+}
+
+/*
+###############################################################################
+#                                                                             #
+#  STATE                                                                      #
+#                                                                             #
+###############################################################################
+*/
+
+// A state file holds a variable table, little-endian, with every position as
+// an offset from the start of the file, so it is used where it is mapped:
+//   header, one record per variable, the names, then the elements of each
+//   vector (aligned to VECTOR_ALIGN, as the kernels expect)
+#define STATE_MAGIC "ZETAST01"
+
+typedef struct {
+    char magic[8];
+    uint64_t size;  // Bytes in the file
+    uint64_t count; // Variables
+} StateHeader;
+
+enum { STATE_NUMBER, STATE_VECTOR };
+
+typedef struct {
+    uint32_t name;   // Offset of the NUL-terminated name
+    uint32_t kind;
+    uint64_t value;  // Bits of the number, or offset of the elements
+    uint64_t length; // Elements of a vector
+} StateRecord;
+
+// Files the variable table starts from and is saved to (NULL if not given),
+// and the mapping of the one loaded
+typedef struct {
+    const char ptr load;
+    const char ptr save;
+    const char ptr map;
+    size_t size;
+} StateFiles;
+
+StateFiles state_files;
+
+// Convert between little-endian and host order
+uint32_t le32(uint32_t value) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    return value;
+}
+
+uint64_t le64(uint64_t value) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+// Map the state file to load and check it. It stays mapped until
+// state_close, however many runs start from it.
+void state_open(void) {
+    const char ptr path = state_files.load;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        error("Cannot open '%s': %s", path, strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, ref st) != 0 || (size_t)st.st_size < sizeof(StateHeader)) {
+        close(fd);
+        error("'%s' is not a state file", path);
+    }
+    size_t size = (size_t)st.st_size;
+    const char ptr map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        error("Cannot map '%s': %s", path, strerror(errno));
+    }
+    state_files.map = map;
+    state_files.size = size;
+
+    const StateHeader ptr header = (const StateHeader ptr)map;
+    uint64_t count = le64(header->count);
+    if (memcmp(header->magic, STATE_MAGIC, sizeof(header->magic)) != 0 || le64(header->size) != size ||
+        count > (size - sizeof(StateHeader)) / sizeof(StateRecord) || count > INT_MAX) {
+        error("'%s' is not a state file", path);
+    }
+    const StateRecord ptr records = (const StateRecord ptr)(map + sizeof(StateHeader));
+    for (uint64_t i = 0; i < count; i++) {
+        uint32_t name = le32(records[i].name);
+        uint64_t bits = le64(records[i].value);
+        uint64_t length = le64(records[i].length);
+        uint32_t kind = le32(records[i].kind);
+        if (name >= size || !memchr(map + name, '\0', size - name)) {
+            error("Corrupt state file '%s'", path);
+        }
+        if (kind != STATE_NUMBER && (kind != STATE_VECTOR || bits % VECTOR_ALIGN != 0 ||
+                                     bits > size || length > (size - bits) / sizeof(Num))) {
+            error("Corrupt state file '%s'", path);
+        }
+    }
+}
+
+// Start the variable table with the variables of the state file. Names are
+// used in place; so are the elements of vectors, unless they need swapping
+// to host order.
+void state_load(Interpreter ptr interpreter) {
+    const char ptr map = state_files.map;
+    VariableTable ptr table = ref interpreter->vtable;
+    uint64_t count = le64(((const StateHeader ptr)map)->count);
+    if (count > 0) {
+        table->vars = malloc(count * sizeof(Variable));
+        if (!table->vars) {
+            error("Memory allocation failed");
+        }
+        table->capacity = (int)count;
+    }
+
+    const StateRecord ptr records = (const StateRecord ptr)(map + sizeof(StateHeader));
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t bits = le64(records[i].value);
+        uint64_t length = le64(records[i].length);
+        Value value;
+        if (le32(records[i].kind) == STATE_NUMBER) {
+            Num num;
+            memcpy(ref num, ref bits, sizeof(num));
+            value = value_num(num);
+        } else {
+            const Num ptr elements = (const Num ptr)(map + bits);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            value = vector_new(length);
+            Num ptr data = value.vector->data;
+            for (uint64_t k = 0; k < length; k++) {
+                uint64_t element;
+                memcpy(ref element, elements + k, sizeof(element));
+                element = le64(element);
+                memcpy(data + k, ref element, sizeof(element));
+            }
+#else
+            value = vector_map(elements, length);
+#endif
+        }
+        table->vars[table->count++] = (Variable){.name = (char ptr)map + le32(records[i].name), .value = value};
+        table->mapped = table->count;
+    }
+}
+
+// Unmap the loaded state file (with no workers running). Vectors over it
+// still alive, left by a statement that failed, are freed first, so none
+// points into it after.
+void state_close(void) {
+    if (!state_files.map) return;
+    for (Vector ptr vector = vectors.all, ptr next; vector; vector = next) {
+        next = vector->next;
+        const char ptr data = (const char ptr)vector->data;
+        if (vector->mapped && data >= state_files.map && data <= state_files.map + state_files.size) {
+            vector_free(vector);
+        }
     }
-    free(node);
-    return result;
+    munmap((void ptr)state_files.map, state_files.size);
+    state_files.map = NULL;
 }
 
-// Visit binary operation node
-Num visit_BinOp(Interpreter ptr interpreter, Ast ptr node) {
-    Num left = visit(interpreter, node->left);
-    Num right = visit(interpreter, node->right);
-    Num result;
-    switch (node->op.type) {
-        case PLUS:
-            result = left + right;
-            break;
-        case MINUS:
-            result = left - right;
-            break;
-        case MUL:
-            result = left * right;
-            break;
-        case DIV:
-            if (right == 0) {
-                error("Division by zero");
+// Write bytes to a state file being saved, keeping the first error in err
+// (the writes after it are skipped)
+void state_write(FILE ptr file, const void ptr data, size_t size, int ptr err) {
+    if (!*err && size && fwrite(data, 1, size, file) != size) {
+        *err = errno ? errno : EIO;
+    }
+}
+
+// Save the variable table as a state file. It is written next to path and
+// renamed over it, so runs that have the old file mapped keep reading it;
+// if that fails, the file written next to it is removed.
+void state_save(Interpreter ptr interpreter, const char ptr path) {
+    const VariableTable ptr table = ref interpreter->vtable;
+    size_t count = (size_t)table->count;
+    StateRecord ptr records = malloc((count ? count : 1) * sizeof(StateRecord));
+    if (!records) {
+        error("Memory allocation failed");
+    }
+
+    // Place the names after the records, then the elements of each vector
+    size_t offset = sizeof(StateHeader) + count * sizeof(StateRecord);
+    for (size_t i = 0; i < count; i++) {
+        records[i] = (StateRecord){.name = le32((uint32_t)offset)};
+        offset += strlen(table->vars[i].name) + 1;
+        if (offset > UINT32_MAX) {
+            free(records);
+            error("Too many variables to save in '%s'", path);
+        }
+    }
+    size_t names_end = offset;
+    for (size_t i = 0; i < count; i++) {
+        Value value = table->vars[i].value;
+        if (is_vector(value)) {
+            offset = (offset + VECTOR_ALIGN - 1) / VECTOR_ALIGN * VECTOR_ALIGN;
+            size_t length = value.vector->length;
+            records[i].kind = le32(STATE_VECTOR);
+            records[i].value = le64(offset);
+            records[i].length = le64(length);
+            offset += length * sizeof(Num);
+        } else {
+            uint64_t bits;
+            memcpy(ref bits, ref value.num, sizeof(bits));
+            records[i].kind = le32(STATE_NUMBER);
+            records[i].value = le64(bits);
+        }
+    }
+    StateHeader header = {.size = le64(offset), .count = le64(count)};
+    memcpy(header.magic, STATE_MAGIC, sizeof(header.magic));
+
+    char temp[PATH_MAX];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    FILE ptr file = fopen(temp, "wb");
+    if (!file) {
+        free(records);
+        error("Cannot create '%s': %s", temp, strerror(errno));
+    }
+    int err = 0;
+    state_write(file, ref header, sizeof(header), ref err);
+    state_write(file, records, count * sizeof(StateRecord), ref err);
+    for (size_t i = 0; i < count; i++) {
+        state_write(file, table->vars[i].name, strlen(table->vars[i].name) + 1, ref err);
+    }
+    offset = names_end;
+    static const char padding[VECTOR_ALIGN];
+    unsigned char block[4096];
+    for (size_t i = 0; i < count && !err; i++) {
+        if (le32(records[i].kind) != STATE_VECTOR) continue;
+        size_t start = le64(records[i].value);
+        state_write(file, padding, start - offset, ref err);
+        const Vector ptr vector = table->vars[i].value.vector;
+        for (size_t k = 0; k < vector->length;) {
+            size_t used = 0;
+            for (; k < vector->length && used < sizeof(block); k++, used += sizeof(Num)) {
+                put_le64(block + used, vector->data[k]);
             }
-            result = left / right;
-            break;
-        default:
-            free(node);
-            error("Unknown operator");
-            break;
+            state_write(file, block, used, ref err);
+        }
+        offset = start + vector->length * sizeof(Num);
+    }
+    free(records);
+    if (fclose(file) != 0 && !err) {
+        err = errno;
+    }
+    if (err) {
+        unlink(temp);
+        error("Cannot write '%s': %s", temp, strerror(err));
+    }
+    if (rename(temp, path) != 0) {
+        err = errno;
+        unlink(temp);
+        error("Cannot replace '%s': %s", path, strerror(err));
     }
-    free(node);
-    return result;
 }
 
-// Visit number node
-Num visit_Num(Interpreter ptr interpreter, Ast ptr node) {
-    Num num =  node->value;
-    free(node);
-    return num;
+/*
+###############################################################################
+#                                                                             #
+#  WATCH                                                                      #
+#                                                                             #
+###############################################################################
+*/
+
+// Quiet time after a change before the file is run again (milliseconds)
+#define WATCH_SETTLE 50
+
+// Parsed unit of the watched file: one line, or the lines of a loop
+typedef struct {
+    uint64_t hash;     // Of the text of the unit
+    char ptr text;     // Compared on a hit: different texts may share a hash
+    size_t size;
+    size_t lines;
+    Ast ptr tree;      // Visited through copies (visiting frees the nodes)
+    unsigned long run; // Last run that used it
+} CachedUnit;
+
+// Units of earlier runs in the order they were parsed, found by content
+// through an open addressing index (unit + 1, 0 = empty)
+typedef struct {
+    CachedUnit ptr units;
+    size_t count;
+    size_t capacity;
+    uint32_t ptr index;
+    size_t index_size; // Power of two
+    size_t used;       // Units used by the current run
+    unsigned long run;
+} UnitCache;
+
+// Hash text 8 bytes at a time
+uint64_t hash_bytes(const char ptr data, size_t size) {
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(ref word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0xBF58476D1CE4E5B9ull;
+        hash ^= hash >> 29;
+    }
+    uint64_t tail = 0;
+    memcpy(ref tail, data + i, size - i);
+    hash = (hash ^ tail) * 0x94D049BB133111EBull;
+    return hash ^ (hash >> 31);
 }
 
-// Visit variable node
-Num visit_Var(Interpreter ptr interpreter, Ast ptr node) {
-    Num num = get_variable(interpreter, node->token.value);
-    free(node);
-    return num;
+// Index all units, with room for the index to stay at most half full
+void UnitCache_reindex(UnitCache ptr cache) {
+    size_t size = 1024;
+    while (size < 2 * cache->count) size *= 2;
+    if (size != cache->index_size) {
+        free(cache->index);
+        cache->index = malloc(size * sizeof(uint32_t));
+        cache->index_size = size;
+        if (!cache->index) {
+            error("Memory allocation failed");
+        }
+    }
+    memset(cache->index, 0, size * sizeof(uint32_t));
+    size_t mask = size - 1;
+    for (size_t u = 0; u < cache->count; u++) {
+        size_t i = cache->units[u].hash & mask;
+        while (cache->index[i]) i = (i + 1) & mask;
+        cache->index[i] = (uint32_t)u + 1;
+    }
 }
 
-// Vist compount node
-void visit_Compound(Interpreter ptr interpreter, Ast ptr node){
-    bool nl = false;
-    for (size_t i = 0; i < node->childrend->elCount; i++)
-    {
-        Ast ptr statement =  *(Ast ptr ptr)darray_get(node->childrend,  i);
-        Num result = visit(interpreter, statement);
-        if(statement->type != AST_NoOp){
-            printf("%g ", result);
-            nl = true;
+// Whether a cached unit has this text
+bool unit_matches(const CachedUnit ptr unit, uint64_t hash, const char ptr text, size_t size) {
+    return unit->hash == hash && unit->size == size && memcmp(unit->text, text, size) == 0;
+}
+
+// Find a cached unit (NULL if there is none). Units usually come back in
+// the same order, so the unit expected next is tried first.
+CachedUnit ptr UnitCache_find(UnitCache ptr cache, uint64_t hash, const char ptr text, size_t size, size_t ptr next) {
+    if (*next < cache->count) {
+        CachedUnit ptr unit = ref cache->units[*next];
+        if (unit_matches(unit, hash, text, size)) {
+            (*next)++;
+            return unit;
         }
     }
-    if (nl) printf("\n");
-    darray_destroy(node->childrend);
-    free(node);
+    size_t mask = cache->index_size - 1;
+    for (size_t i = hash & mask; cache->index[i]; i = (i + 1) & mask) {
+        CachedUnit ptr unit = ref cache->units[cache->index[i] - 1];
+        if (unit_matches(unit, hash, text, size)) {
+            // A repeated line points back at an earlier unit: keep the expected one
+            if (cache->index[i] > *next) *next = cache->index[i];
+            return unit;
+        }
+    }
+    return NULL;
 }
 
-// Vist no operation node
-void visit_NoOp(Interpreter ptr interpreter, Ast ptr node){
-    // nothing
-    free(node);
+// Add a unit used by the current run, with a copy of its text
+CachedUnit ptr UnitCache_add(UnitCache ptr cache, CachedUnit unit) {
+    if (cache->count == cache->capacity) {
+        cache->capacity = cache->capacity ? cache->capacity * 2 : 1024;
+        cache->units = realloc(cache->units, cache->capacity * sizeof(CachedUnit));
+        if (!cache->units) {
+            error("Memory allocation failed");
+        }
+    }
+    const char ptr text = unit.text;
+    unit.text = malloc(unit.size);
+    if (!unit.text) {
+        error("Memory allocation failed");
+    }
+    memcpy(unit.text, text, unit.size);
+    cache->units[cache->count++] = unit;
+    cache->used++;
+    if (2 * cache->count > cache->index_size) {
+        UnitCache_reindex(cache);
+    } else {
+        size_t mask = cache->index_size - 1;
+        size_t i = unit.hash & mask;
+        while (cache->index[i]) i = (i + 1) & mask;
+        cache->index[i] = (uint32_t)cache->count;
+    }
+    return ref cache->units[cache->count - 1];
 }
 
-// Generic visit function
-Num visit(Interpreter ptr interpreter, Ast ptr node) {
-    switch (node->type) {
-        case AST_ASSIGN:
-            return visit_AssignOp(interpreter, node);
-        case AST_UNARY:
-            return visit_UnaryOp(interpreter, node);
-        case AST_BINOP:
-            return visit_BinOp(interpreter, node);
-        case AST_NUM:
-            return visit_Num(interpreter, node);
-        case AST_VAR:
-            return visit_Var(interpreter, node);
-        case AST_COMPOUND:
-            visit_Compound(interpreter, node);
-            break;
-        case AST_NoOp:
-            visit_NoOp(interpreter, node);
-            break;
-        default:
-            error("No visit function for this node type");
+// Drop the units the file no longer has, once they are a quarter of the cache
+void UnitCache_prune(UnitCache ptr cache) {
+    if (4 * (cache->count - cache->used) <= cache->count) return;
+    size_t kept = 0;
+    for (size_t u = 0; u < cache->count; u++) {
+        if (cache->units[u].run == cache->run) {
+            cache->units[kept++] = cache->units[u];
+        } else {
+            Ast_Destroy(cache->units[u].tree);
+            free(cache->units[u].text);
+        }
     }
-    return -1; // <- will never reach
+    cache->count = kept;
+    UnitCache_reindex(cache);
 }
 
-// Interpreter initialization
-Interpreter Interpreter_Init(Parser ptr parser) {
-    return (Interpreter){
-        .parser = parser
-    };
+// Read a whole file (NULL if it can't be read)
+char ptr read_file(const char ptr path, size_t ptr size) {
+    FILE ptr file = fopen(path, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    rewind(file);
+    char ptr data = length >= 0 ? malloc((size_t)length + 1) : NULL;
+    if (data) {
+        *size = fread(data, 1, (size_t)length, file);
+        data[*size] = '\0';
+    }
+    fclose(file);
+    return data;
 }
 
-// Main interpret function
-void interpret(Interpreter ptr interpreter) {
-    while (interpreter->parser->current_token.type != EOF_TOKEN) 
-    {
-        Ast ptr tree = parse(interpreter->parser);
-        visit(interpreter, tree);
+// End of the unit starting at start: the line, and more lines while a '{' is open
+size_t unit_end(const char ptr data, size_t size, size_t start, size_t ptr lines) {
+    int depth = 0;
+    size_t pos = start;
+    *lines = 0;
+    do {
+        const char ptr nl = memchr(data + pos, '\n', size - pos);
+        size_t end = nl ? (size_t)(nl - data) + 1 : size;
+        for (size_t i = pos; i < end; i++) {
+            if (data[i] == '{') depth++;
+            else if (data[i] == '}') depth--;
+        }
+        pos = end;
+        (*lines)++;
+    } while (depth > 0 && pos < size);
+    return pos;
+}
+
+// Run the file once, parsing only the units that are not cached
+void watch_run(const char ptr path, UnitCache ptr cache, bool stats) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, ref now);
+    double start_time = now.tv_sec + now.tv_nsec * 1e-9;
+
+    size_t size = 0;
+    char ptr data = read_file(path, ref size);
+    if (!data) {
+        fprintf(stderr, "Cannot read '%s'\n", path);
+        return;
+    }
+    FILE ptr file = size ? fmemopen(data, size, "rb") : NULL;
+    if (!file) {
+        fprintf(stderr, "[watch] nothing to run\n");
+        free(data);
+        return;
+    }
+
+    cache->run++;
+    cache->used = 0;
+    Output_Reset();
+    AstLog_Start();
+    Lexer lexer = Lexer_Init(file);
+    Parser parser = Parser_Init(ref lexer);
+    Interpreter interpreter = Interpreter_Init(ref parser);
+    volatile size_t lines = 0, reused = 0; // Read after an error
+    bool failed = false;
+
+    ErrorTrap trap;
+    if (setjmp(trap.env) == 0) {
+        error_trap = ref trap;
+        if (state_files.load) {
+            state_load(ref interpreter);
+        }
+        bool positioned = true; // The lexer is at the start of the next unit
+        size_t next = 0;        // Cached unit expected next
+        for (size_t start = 0; start < size;) {
+            size_t unit_lines;
+            size_t end = unit_end(data, size, start, ref unit_lines);
+            uint64_t hash = hash_bytes(data + start, end - start);
+            CachedUnit ptr unit = UnitCache_find(cache, hash, data + start, end - start, ref next);
+            size_t row = lines;
+            lines += unit_lines;
+
+            if (unit) {
+                if (unit->run != cache->run) cache->used++;
+                unit->run = cache->run;
+                reused += unit_lines;
+                positioned = false;
+                visit(ref interpreter, Ast_Clone(unit->tree));
+            } else {
+                if (!positioned) {
+                    LexerMark mark = {.chunk_pos = (long)start, .row = row};
+                    Lexer_Reset(ref lexer, ref mark);
+                    parser.current_token = get_next_token(ref lexer);
+                    positioned = true;
+                }
+                Ast ptr tree = parse(ref parser);
+                if (tree) {
+                    unit = UnitCache_add(cache, (CachedUnit){hash, data + start, end - start, unit_lines, tree, cache->run});
+                    AstLog_Forget(); // The cache owns the tree
+                    next = cache->count;
+                    visit(ref interpreter, Ast_Clone(unit->tree));
+                } else {
+                    interpret_stream(ref interpreter);
+                }
+            }
+            AstLog_Forget(); // Functions own the bodies they kept
+            start = end;
+        }
+        if (state_files.save) {
+            state_save(ref interpreter, state_files.save);
+        }
+        error_trap = NULL;
+    } else {
+        // Report it like error() does, without exiting
+        failed = true;
+        frames_free_all();
+        fputs(trap.message, stderr);
+        if (text_stdout) printf("\n");
+        else fputc('\n', stderr);
+    }
+    if (!output_flush()) output_failed();
+    if (stats) print_memo_stats(ref interpreter);
+
+    clock_gettime(CLOCK_MONOTONIC, ref now);
+    fprintf(stderr, "[watch] %zu of %zu lines reused, %.3fs\n", reused, lines,
+            now.tv_sec + now.tv_nsec * 1e-9 - start_time);
+
+    // Function bodies go with the interpreter; what an error left of the
+    // trees of its unit is still logged, and so are its temporaries
+    Interpreter_Destroy(ref interpreter);
+    AstLog_Stop();
+    if (failed) vectors_free_all();
+    // After an error the units past it were not used, but are still in the file
+    if (!failed) UnitCache_prune(cache);
+    Lexer_Destroy(ref lexer);
+    fclose(file);
+    free(data);
+}
+
+// Run the file, then again whenever it changes
+void watch(const char ptr path, bool stats) {
+    char full[PATH_MAX];
+    strcpy(full, get_full_path(path));
+    char ptr slash = strrchr(full, '/');
+    const char ptr name = slash + 1;
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash - full) + 1, full);
+
+    // Watch the directory: editors often replace the file instead of writing it
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MODIFY) < 0) {
+        error("Cannot watch '%s': %s", path, strerror(errno));
+    }
+
+    // Every run starts from the state file as it was now, not from what
+    // the runs before saved
+    if (state_files.load) {
+        state_open();
+    }
+    UnitCache cache = {0};
+    UnitCache_reindex(ref cache);
+    watch_run(full, ref cache, stats);
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        // Wait for a change of the file, then for the writes to settle
+        bool changed = false;
+        int timeout = -1;
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        while (poll(ref pfd, 1, timeout) > 0) {
+            ssize_t length = read(fd, events, sizeof(events));
+            for (ssize_t i = 0; i < length;) {
+                struct inotify_event ptr event = (struct inotify_event ptr)(events + i);
+                if (event->len && strcmp(event->name, name) == 0) {
+                    changed = true;
+                }
+                i += sizeof(struct inotify_event) + event->len;
+            }
+            if (changed) timeout = WATCH_SETTLE;
+        }
+        if (changed) {
+            watch_run(full, ref cache, stats);
+        }
     }
 }
 
+// Command line options
+typedef struct {
+    const char ptr path;
+    bool parallel; // Evaluate independent statements on a thread pool
+    int jobs;      // Worker count for parallel mode (0 = number of CPUs)
+    bool stats;    // Print memo cache counters to stderr at exit
+    OutputFormat format;
+    const char ptr output; // File (directory for columns) results are written to
+    bool watch;    // Run again whenever the file changes
+    const char ptr load_state; // State file the variables start from
+    const char ptr save_state; // State file the variables are saved to
+} Options;
+
 // Check args for the file to interpret
-FILE ptr parse_args(int argc, char ptr argv[]) {
-    if (argc < 2) {
+FILE ptr parse_args(int argc, char ptr argv[], Options ptr options) {
+    *options = (Options){0};
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) {
+            options->parallel = true;
+            if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) {
+                options->jobs = atoi(argv[++i]);
+            }
+        } else if (strncmp(argv[i], "-j", 2) == 0 && isdigit((unsigned char)argv[i][2])) {
+            options->parallel = true;
+            options->jobs = atoi(argv[i] + 2);
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            options->stats = true;
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            options->watch = true;
+        } else if (strcmp(argv[i], "--load-state") == 0 && i + 1 < argc) {
+            options->load_state = argv[++i];
+        } else if (strcmp(argv[i], "--save-state") == 0 && i + 1 < argc) {
+            options->save_state = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            options->output = argv[++i];
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            const char ptr format = argv[++i];
+            if (strcmp(format, "text") == 0) options->format = OUTPUT_TEXT;
+            else if (strcmp(format, "raw") == 0) options->format = OUTPUT_RAW;
+            else if (strcmp(format, "records") == 0) options->format = OUTPUT_RECORDS;
+            else if (strcmp(format, "columns") == 0) options->format = OUTPUT_COLUMNS;
+            else error("Unknown output format '%s' (text, raw, records or columns)", format);
+        } else {
+            options->path = argv[i];
+        }
+    }
+
+    if (options->watch && options->parallel) {
+        error("--watch runs the file on one thread: -j can't be used with it");
+    }
+
+    if (!options->path) {
         error("zeta.exe: fatal error: no input files.\ncompilation terminated.\n");
         return NULL;
     }
 
-    FILE ptr f = fopen(get_full_path(argv[1]), "r");
+    FILE ptr f = fopen(options->path, "rb");
     if (!f) {
-        error("Cannot find '%s': No such file or directory.\n", argv[1]);
+        error("Cannot find '%s': No such file or directory.\n", options->path);
         return NULL;
     }
 
     return f;
 }
 
+#if !defined(ZETA_BENCH) && !defined(ZETA_TEST)
 int main(int argc, char ptr argv[]) 
 {
-    FILE ptr file = parse_args(argc, argv);
+    Options options;
+    FILE ptr file = parse_args(argc, argv, ref options);
+    Output_Init(options.format, options.output);
+    state_files = (StateFiles){.load = options.load_state, .save = options.save_state};
+    if (options.watch) {
+        fclose(file);
+        watch(options.path, options.stats);
+        return 0;
+    }
     
     // Setup lexer and parser
     Lexer lexer = Lexer_Init(file);
     Parser parser = Parser_Init(ref lexer);
     Interpreter interpreter = Interpreter_Init(ref parser);
+    if (state_files.load) {
+        state_open();
+        state_load(ref interpreter);
+    }
 
     // Evaluate
-    interpret(ref interpreter); 
+    if (options.parallel) {
+        interpret_parallel(ref interpreter, options.jobs);
+    } else {
+        interpret(ref interpreter); 
+    }
+    if (state_files.save) {
+        state_save(ref interpreter, state_files.save);
+    }
+    if (options.stats) {
+        print_memo_stats(ref interpreter);
+    }
 
     // Release resources
-    free(lexer.line);
+    Interpreter_Destroy(ref interpreter);
+    state_close();
+    Lexer_Destroy(ref lexer);
+    fclose(lexer.file);
+
+    return 0;
+}
+#endif
+
+/*
+###############################################################################
+#                                                                             #
+#  BENCHMARKS                                                                 #
+#                                                                             #
+###############################################################################
+*/
+
+#ifdef ZETA_BENCH
+
+// Keeps benchmark results alive
+volatile size_t bench_sink;
+
+// Wall clock in seconds
+double bench_now(void) {
+    struct timespec ts;
+    timespec_get(ref ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Print throughput of one benchmark in millions of operations per second
+void bench_report(const char ptr name, const char ptr shape, size_t ops, double seconds) {
+    printf("%-28s %-22s %10.1f Mops/s\n", name, shape, ops / seconds / 1e6);
+}
+
+// Print throughput of one benchmark in megabytes per second
+void bench_report_bytes(const char ptr name, const char ptr shape, size_t bytes, double seconds) {
+    printf("%-28s %-22s %10.1f MB/s\n", name, shape, bytes / seconds / 1e6);
+}
+
+// Lex a file of `lines` copies of `line` with every scanner the CPU supports
+void bench_lexer(const char ptr shape, const char ptr line, size_t lines) {
+    FILE ptr file = tmpfile();
+    if (!file) error("Cannot create benchmark input");
+    for (size_t i = 0; i < lines; i++) fputs(line, file);
+    size_t bytes = strlen(line) * lines;
+
+    for (size_t i = 0; i < CHAR_SCANNERS; i++) {
+        if (!char_scanners[i].supported()) continue;
+        rewind(file);
+        Lexer lexer = Lexer_Init(file);
+        char_scanner = ref char_scanners[i];
+        size_t tokens = 0;
+
+        double start = bench_now();
+        while (get_next_token(ref lexer).type != EOF_TOKEN) tokens++;
+        double seconds = bench_now() - start;
+
+        char name[32];
+        snprintf(name, sizeof(name), "lexer (%s)", char_scanners[i].name);
+        bench_report_bytes(name, shape, bytes, seconds);
+        Lexer_Destroy(ref lexer);
+        bench_sink = tokens;
+    }
+    fclose(file);
+}
+
+// Many short arrays, like the statement lists of Compound nodes
+void bench_darray_small(size_t arrays, size_t length) {
+    char shape[32];
+    snprintf(shape, sizeof(shape), "%zu x %zu", arrays, length);
+    size_t ops = arrays * length;
+    size_t sum = 0;
+
+    double start = bench_now();
+    for (size_t a = 0; a < arrays; a++) {
+        darray ptr array = darray_create(size_t);
+        for (size_t i = 0; i < length; i++) darray_add(array, ref i);
+        for (size_t i = 0; i < length; i++) sum += *(size_t ptr)darray_get(array, i);
+        darray_destroy(array);
+    }
+    bench_report("darray add+get", shape, ops, bench_now() - start);
+
+    start = bench_now();
+    for (size_t a = 0; a < arrays; a++) {
+        SizeArray array = SizeArray_Init();
+        for (size_t i = 0; i < length; i++) SizeArray_add(ref array, i);
+        for (size_t i = 0; i < length; i++) sum += SizeArray_get(ref array, i);
+        SizeArray_destroy(ref array);
+    }
+    bench_report("SizeArray add+get", shape, ops, bench_now() - start);
+
+    start = bench_now();
+    for (size_t a = 0; a < arrays; a++) {
+        SizeArray array = SizeArray_Init();
+        for (size_t i = 0; i < length; i++) SizeArray_add(ref array, i);
+        for (size_t i = 0; i < length; i++) sum += SizeArray_at(ref array, i);
+        SizeArray_destroy(ref array);
+    }
+    bench_report("SizeArray add+at", shape, ops, bench_now() - start);
+    bench_sink = sum;
+}
+
+// One long array: add throughput, then get throughput
+void bench_darray_large(size_t length) {
+    char shape[32];
+    snprintf(shape, sizeof(shape), "1 x %zu", length);
+    size_t sum = 0;
+
+    darray ptr old = darray_create(size_t);
+    double start = bench_now();
+    for (size_t i = 0; i < length; i++) darray_add(old, ref i);
+    bench_report("darray add", shape, length, bench_now() - start);
+    start = bench_now();
+    for (size_t i = 0; i < length; i++) sum += *(size_t ptr)darray_get(old, i);
+    bench_report("darray get", shape, length, bench_now() - start);
+    darray_destroy(old);
+
+    SizeArray array = SizeArray_Init();
+    start = bench_now();
+    for (size_t i = 0; i < length; i++) SizeArray_add(ref array, i);
+    bench_report("SizeArray add", shape, length, bench_now() - start);
+    start = bench_now();
+    for (size_t i = 0; i < length; i++) sum += SizeArray_get(ref array, i);
+    bench_report("SizeArray get", shape, length, bench_now() - start);
+    start = bench_now();
+    for (size_t i = 0; i < length; i++) sum += SizeArray_at(ref array, i);
+    bench_report("SizeArray at", shape, length, bench_now() - start);
+    SizeArray_destroy(ref array);
+    bench_sink = sum;
+}
+
+// Element-wise add and sum of vectors with every kernel set the CPU supports
+void bench_vectors(size_t length, size_t rounds) {
+    char shape[32];
+    snprintf(shape, sizeof(shape), "%zu x %zu", rounds, length);
+    size_t bytes = length * sizeof(Num);
+    Num ptr a = aligned_alloc(VECTOR_ALIGN, bytes);
+    Num ptr b = aligned_alloc(VECTOR_ALIGN, bytes);
+    Num ptr out = aligned_alloc(VECTOR_ALIGN, bytes);
+    if (!a || !b || !out) error("Cannot allocate benchmark vectors");
+    for (size_t i = 0; i < length; i++) {
+        a[i] = i * 0.5;
+        b[i] = length - i;
+    }
+
+    for (size_t i = 0; i < VECTOR_KERNEL_SETS; i++) {
+        const VectorKernels ptr kernels = ref vector_kernels[i];
+        if (!kernels->supported()) continue;
+        char name[32];
+
+        double start = bench_now();
+        for (size_t r = 0; r < rounds; r++) kernels->vv[0](out, a, b, length);
+        snprintf(name, sizeof(name), "vector add (%s)", kernels->name);
+        bench_report_bytes(name, shape, 3 * bytes * rounds, bench_now() - start);
+
+        Num sum = 0;
+        start = bench_now();
+        for (size_t r = 0; r < rounds; r++) sum += kernels->sum(out, length);
+        snprintf(name, sizeof(name), "vector sum (%s)", kernels->name);
+        bench_report_bytes(name, shape, bytes * rounds, bench_now() - start);
+        bench_sink = (size_t)sum;
+    }
+    free(a);
+    free(b);
+    free(out);
+}
+
+// Evaluate a program of `lines` lines, each assigning one of 256 variables
+// a sum of `terms` products of 48 others, first sequentially, then with -j
+// 2, 4, ... up to the number of CPUs
+void bench_parallel(size_t lines, size_t terms) {
+    FILE ptr file = tmpfile();
+    if (!file) error("Cannot create benchmark input");
+    for (int v = 0; v < 48; v++) fprintf(file, "v%d = %d; ", v, v + 1);
+    fputc('\n', file);
+    unsigned seed = 1;
+    for (size_t i = 0; i < lines; i++) {
+        fprintf(file, "w%zu = 0", i % 256);
+        for (size_t t = 0; t < terms; t++) {
+            seed = seed * 1103515245 + 12345;
+            fprintf(file, " + v%u * %u", (seed >> 16) % 48, (seed >> 8) % 9 + 1);
+        }
+        fputc('\n', file);
+    }
+    char shape[32];
+    snprintf(shape, sizeof(shape), "%zu x %zu terms", lines, terms);
+    Output_Init(OUTPUT_RAW, "/dev/null");
+
+    for (int jobs = 1; jobs <= worker_count(0); jobs *= 2) {
+        rewind(file);
+        Lexer lexer = Lexer_Init(file);
+        Parser parser = Parser_Init(ref lexer);
+        Interpreter interpreter = Interpreter_Init(ref parser);
+
+        double start = bench_now();
+        if (jobs == 1) {
+            interpret(ref interpreter);
+        } else {
+            interpret_parallel(ref interpreter, jobs);
+        }
+        double seconds = bench_now() - start;
+        if (!output_flush()) output_failed();
+
+        char name[32];
+        snprintf(name, sizeof(name), jobs == 1 ? "interpret" : "interpret -j %d", jobs);
+        printf("%-28s %-22s %10.1f ms\n", name, shape, seconds * 1e3);
+        Interpreter_Destroy(ref interpreter);
+        Lexer_Destroy(ref lexer);
+    }
+    fclose(file);
+}
+
+int main(void) 
+{
+    bench_darray_small(1000000, 1);
+    bench_darray_small(1000000, 3);
+    bench_darray_small(100000, 32);
+    bench_darray_large(10000000);
+    bench_lexer("whitespace-heavy",
+                "x   =       1          +\t\t\t\t  y      ;                                 z = 2\n", 400000);
+    bench_lexer("literal-heavy",
+                "variableNumberOne = 123456789012 * anotherLongVariable + 3141592653589793 / 27\n", 400000);
+    bench_vectors(1 << 10, 100000);
+    bench_vectors(1 << 20, 100);
+    bench_parallel(20000, 64);
+    return 0;
+}
+
+#endif
+
+/*
+###############################################################################
+#                                                                             #
+#  SELF TESTS                                                                 #
+#                                                                             #
+###############################################################################
+*/
+
+#ifdef ZETA_TEST
+
+// Number of failed checks
+int test_failures = 0;
+
+#define test_check(cond, ...)                                                  \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            fprintf(stderr, __VA_ARGS__);                                      \
+            fputc('\n', stderr);                                               \
+            test_failures++;                                                   \
+        }                                                                      \
+    } while (0)
+
+// Every scanner the CPU supports finds the same runs as the scalar one, on
+// random text mostly made of the characters they look for
+void test_char_scanners(void) {
+    static const char common[] = " \t\r\n\v\f09azAZ_.@[`{/:";
+    char buf[256];
+    srand(1);
+    CharScanner_Init();
+    for (int round = 0; round < 2000; round++) {
+        for (size_t i = 0; i < sizeof(buf); i++) {
+            buf[i] = rand() % 4 ? common[rand() % (sizeof(common) - 1)] : (char)(rand() % 256);
+        }
+        // Long runs so that the vector loops run more than once
+        size_t run = (size_t)(rand() % 100);
+        memset(buf + rand() % 64, "  a7"[round % 4], run);
+        size_t start = (size_t)(rand() % 32);
+        size_t n = (size_t)(rand() % (int)(sizeof(buf) - start));
+
+        const CharScanner ptr scalar = ref char_scanners[0];
+        for (size_t i = 1; i < CHAR_SCANNERS; i++) {
+            const CharScanner ptr scanner = ref char_scanners[i];
+            if (!scanner->supported()) continue;
+            test_check(scanner->space(buf + start, n) == scalar->space(buf + start, n),
+                       "%s space span differs in round %d", scanner->name, round);
+            test_check(scanner->alnum(buf + start, n) == scalar->alnum(buf + start, n),
+                       "%s alnum span differs in round %d", scanner->name, round);
+            test_check(scanner->digit(buf + start, n) == scalar->digit(buf + start, n),
+                       "%s digit span differs in round %d", scanner->name, round);
+        }
+    }
+    // The scalar scanner agrees with the C library
+    for (int c = 0; c < 256; c++) {
+        char ch = (char)c;
+        test_check(!!span_space_scalar(ref ch, 1) == !!(isspace(c) && c < 128), "space class of %d", c);
+        test_check(!!span_alnum_scalar(ref ch, 1) == !!(isalnum(c) && c < 128), "alnum class of %d", c);
+        test_check(!!span_digit_scalar(ref ch, 1) == !!isdigit(c), "digit class of %d", c);
+    }
+}
+
+// Whether two results are the same number (any NaN equals any other)
+bool test_same(Num a, Num b) {
+    return (a != a && b != b) || memcmp(ref a, ref b, sizeof(Num)) == 0;
+}
+
+// Every kernel set the CPU supports computes what the scalar one does, for
+// every length up to a few times the widest loop
+void test_vector_kernels(void) {
+    enum { LENGTH = 72 };
+    Num ptr a = aligned_alloc(VECTOR_ALIGN, LENGTH * sizeof(Num));
+    Num ptr b = aligned_alloc(VECTOR_ALIGN, LENGTH * sizeof(Num));
+    Num ptr want = aligned_alloc(VECTOR_ALIGN, LENGTH * sizeof(Num));
+    Num ptr got = aligned_alloc(VECTOR_ALIGN, LENGTH * sizeof(Num));
+    srand(2);
+    const VectorKernels ptr scalar = ref vector_kernels[0];
+    for (size_t n = 0; n <= LENGTH; n++) {
+        for (size_t i = 0; i < n; i++) {
+            a[i] = (rand() % 2001 - 1000) / 8.0;
+            b[i] = rand() % 8 ? (rand() % 2001 - 1000) / 16.0 : 0;
+        }
+        Num s = (rand() % 200 - 100) / 4.0;
+        for (size_t k = 1; k < VECTOR_KERNEL_SETS; k++) {
+            const VectorKernels ptr kernels = ref vector_kernels[k];
+            if (!kernels->supported()) continue;
+            for (int op = 0; op < 4; op++) {
+                scalar->vv[op](want, a, b, n);
+                kernels->vv[op](got, a, b, n);
+                for (size_t i = 0; i < n; i++) {
+                    test_check(test_same(want[i], got[i]), "%s vv op %d differs at %zu of %zu", kernels->name, op, i, n);
+                }
+                scalar->vs[op](want, a, s, n);
+                kernels->vs[op](got, a, s, n);
+                for (size_t i = 0; i < n; i++) {
+                    test_check(test_same(want[i], got[i]), "%s vs op %d differs at %zu of %zu", kernels->name, op, i, n);
+                }
+                scalar->sv[op](want, s, b, n);
+                kernels->sv[op](got, s, b, n);
+                for (size_t i = 0; i < n; i++) {
+                    test_check(test_same(want[i], got[i]), "%s sv op %d differs at %zu of %zu", kernels->name, op, i, n);
+                }
+            }
+            scalar->neg(want, a, n);
+            kernels->neg(got, a, n);
+            for (size_t i = 0; i < n; i++) {
+                test_check(test_same(want[i], got[i]), "%s neg differs at %zu of %zu", kernels->name, i, n);
+            }
+            test_check(test_same(scalar->sum(a, n), kernels->sum(a, n)), "%s sum differs for %zu", kernels->name, n);
+            if (n > 0) {
+                test_check(test_same(scalar->min(a, n), kernels->min(a, n)), "%s min differs for %zu", kernels->name, n);
+                test_check(test_same(scalar->max(a, n), kernels->max(a, n)), "%s max differs for %zu", kernels->name, n);
+            }
+            test_check(scalar->any_zero(b, n) == kernels->any_zero(b, n), "%s any_zero differs for %zu", kernels->name, n);
+        }
+    }
+    free(a);
+    free(b);
+    free(want);
+    free(got);
+}
+
+// Run a program with its results thrown away
+void test_run(const char ptr source, Interpreter ptr interpreter, Lexer ptr lexer, Parser ptr parser) {
+    FILE ptr file = fmemopen((void ptr)source, strlen(source), "rb");
+    *lexer = Lexer_Init(file);
+    *parser = Parser_Init(lexer);
+    *interpreter = Interpreter_Init(parser);
+    interpret(interpreter);
+    output_flush();
+}
+
+// Operators write into temporaries only, and the last reference to a
+// vector frees it, however the program got there
+void test_vector_refs(void) {
+    VectorKernels_Init();
+    size_t alive = vectors.count;
+
+    Value v = vector_new(3);
+    for (size_t i = 0; i < 3; i++) v.vector->data[i] = (Num)i;
+    Value shared = vector_binop(MUL, value_retain(v), value_num(2));
+    test_check(shared.vector != v.vector, "a variable's vector was written to");
+    test_check(v.vector->data[2] == 2, "a variable's vector changed");
+    Value temp = vector_binop(PLUS, shared, value_num(1));
+    test_check(temp.vector == shared.vector && temp.vector->data[2] == 5, "a temporary was not reused");
+    temp = vector_negate(temp);
+    test_check(temp.vector->data[1] == -3, "negation is wrong");
+    value_release(temp);
+    value_release(v);
+    test_check(vectors.count == alive, "%zu vectors left", vectors.count - alive);
+
+    // Loops, functions (inlined, called and memoized) and builtins
+    Output_Init(OUTPUT_RAW, "/dev/null");
+    Interpreter interpreter;
+    Lexer lexer;
+    Parser parser;
+    test_run("def twice(x) = x + x\n"
+             "def big(x) = x * 2 + x * 3 - x / 4 + x * 5 - x + x * 6 + x * 7\n"
+             "memo neg(x) = -x\n"
+             "v = [1, 2, 3]\n"
+             "repeat 1000 { w = twice(v) / 2 + 1; v = neg(w - 1); u = big(v) * sum(v) }\n"
+             "n = 3; while n { t = [n, n] * n; n = n - 1 }\n",
+             ref interpreter, ref lexer, ref parser);
+    // v, w, u and t
+    test_check(vectors.count == alive + 4, "%zu vectors alive after the loops, not 4", vectors.count - alive);
+    Interpreter_Destroy(ref interpreter);
+    Lexer_Destroy(ref lexer);
     fclose(lexer.file);
-    free(interpreter.vtable.vars);
+    test_check(vectors.count == alive, "%zu vectors left with the interpreter gone", vectors.count - alive);
+}
+
+// A unit is found by its text, not only by its hash
+void test_unit_cache(void) {
+    UnitCache cache = {0};
+    UnitCache_reindex(ref cache);
+    char text[] = "a = 1\n";
+    UnitCache_add(ref cache, (CachedUnit){42, text, 6, 1, Ast_NoOp_Init(), cache.run});
+    size_t next = 0;
+    test_check(UnitCache_find(ref cache, 42, "b = 2\n", 6, ref next) == NULL, "a unit was found by its hash alone");
+    next = 0;
+    test_check(UnitCache_find(ref cache, 42, "a = 1\n", 6, ref next) == ref cache.units[0], "a cached unit was not found");
+    Ast_Destroy(cache.units[0].tree);
+    free(cache.units[0].text);
+    free(cache.units);
+    free(cache.index);
+}
 
+int main(void)
+{
+    test_char_scanners();
+    test_vector_kernels();
+    test_vector_refs();
+    test_unit_cache();
+    if (test_failures) {
+        fprintf(stderr, "%d checks failed\n", test_failures);
+        return 1;
+    }
+    printf("self tests passed\n");
     return 0;
-}
\ No newline at end of file
+}
+
+#endif